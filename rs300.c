@@ -7,7 +7,9 @@
 
 // TODO: Remove unused headers
 #include <linux/clk.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
+#include <linux/device.h>
 #include <linux/err.h>
 #include <linux/gpio/consumer.h>
 #include <linux/init.h>
@@ -15,15 +17,19 @@
 #include <linux/io.h>
 #include <linux/i2c.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/media.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_graph.h>
 #include <linux/regulator/consumer.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
 #include <linux/uaccess.h>
 #include <linux/videodev2.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <media/media-entity.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-ctrls.h>
@@ -34,21 +40,54 @@
 #include <media/v4l2-mediabus.h>
 #include <media/v4l2-subdev.h>
 #include <linux/pinctrl/consumer.h>
+#include <linux/pm_runtime.h>
 
 
 #define DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x1)
 #define DRIVER_NAME "rs300"
-//80M (clk)* 2(double ) *2 (lan) /8
-//80Mhz works for 640x512
-//400, 80, 40, and 20Mhz does not work for 256x192
-#define RS300_LINK_RATE (80 * 1000 * 1000)
-#define RS300_PIXEL_RATE	(40 * 1000 * 1000)
-//#define RS300_PIXEL_RATE_256	(20 * 1000 * 1000)
+/*
+ * The camera firmware sets its own MIPI clock; the endpoint's
+ * link-frequencies list the rates the module can run at.
+ * 80Mhz works for 640x512
+ * 400, 80, 40, and 20Mhz does not work for 256x192
+ */
+#define RS300_MAX_LINK_FREQS	4
 #define RS300_BRIGHTNESS_MIN 0
 #define RS300_BRIGHTNESS_MAX 100
 #define RS300_BRIGHTNESS_STEP 10
 #define RS300_BRIGHTNESS_DEFAULT 50
 #define V4L2_CID_CUSTOM_BASE (V4L2_CID_USER_BASE + 1000 )
+#define V4L2_CID_RS300_ASYNC_CTRL (V4L2_CID_CUSTOM_BASE + 7)
+#define V4L2_CID_RS300_REFRESH (V4L2_CID_CUSTOM_BASE + 8)
+#define V4L2_CID_RS300_VERIFY (V4L2_CID_CUSTOM_BASE + 9)
+#define V4L2_CID_RS300_VERIFY_INTERVAL (V4L2_CID_CUSTOM_BASE + 10)
+#define V4L2_CID_RS300_STANDBY (V4L2_CID_CUSTOM_BASE + 11)
+#define V4L2_CID_RS300_FRAME_META (V4L2_CID_CUSTOM_BASE + 12)
+#define V4L2_CID_RS300_FFC_INTERVAL (V4L2_CID_CUSTOM_BASE + 13)
+#define V4L2_CID_RS300_FFC_DEFER (V4L2_CID_CUSTOM_BASE + 14)
+#define V4L2_CID_RS300_FFC_ON_STOP (V4L2_CID_CUSTOM_BASE + 15)
+#define V4L2_CID_RS300_PROFILE (V4L2_CID_CUSTOM_BASE + 16)
+#define V4L2_CID_RS300_PROFILE_SAVE (V4L2_CID_CUSTOM_BASE + 17)
+#define V4L2_CID_RS300_PERSIST (V4L2_CID_CUSTOM_BASE + 18)
+
+/*
+ * Shutter calibration start and end. u.data[0] is the rs300_ffc_reason,
+ * u.data[1] is set on the end event if the calibration failed.
+ */
+#define RS300_EVENT_FFC_START (V4L2_EVENT_PRIVATE_START + 1)
+#define RS300_EVENT_FFC_END (V4L2_EVENT_PRIVATE_START + 2)
+
+/*
+ * An asynchronous control write has reached the camera, or failed. The
+ * event id is the control id; u.data holds a struct rs300_ctrl_done.
+ */
+#define RS300_EVENT_CTRL_DONE (V4L2_EVENT_PRIVATE_START + 3)
+
+struct rs300_ctrl_done {
+	__u32 id;
+	__s32 value;	/* Value the camera holds now */
+	__s32 error;	/* 0 if applied, else the negative error code */
+};
 
 /* Define colormap menu items with the actual names */
 static const char * const colormap_menu[] = {
@@ -82,23 +121,77 @@ static const char * const scene_mode_menu[] = {
     NULL
 };
 
+/* Read back parameters after setting them */
+enum rs300_verify {
+    RS300_VERIFY_OFF,
+    RS300_VERIFY_SAMPLED,   /* Every verify_interval-th write */
+    RS300_VERIFY_ALWAYS,
+};
+
+static const char * const verify_menu[] = {
+    "Off",
+    "Sampled",
+    "Always",
+    NULL
+};
+
+/* Keep the video path running between streams */
+enum rs300_standby {
+    RS300_STANDBY_OFF,
+    RS300_STANDBY_ON,		/* Stay armed after stream-off */
+    RS300_STANDBY_PREARM,	/* ...and arm once probed */
+};
+
+static const char * const standby_menu[] = {
+    "Off",
+    "After Stream-off",
+    "From Probe",
+    NULL
+};
+
+/* Image parameter sets held by the driver; Default holds the control defaults */
+#define RS300_NUM_PROFILES	4
+
+static const char * const profile_menu[] = {
+    "Default",
+    "User 1",
+    "User 2",
+    "User 3",
+    NULL
+};
+
 #define NUM_COLORMAP_ITEMS (ARRAY_SIZE(colormap_menu) - 1) // Account for NULL terminator
 
 // Mode must be set before running setup.sh
-// TODO: Make mode adjustable during runtime
+/* Defaults for cameras whose DT node does not set infisense,mode/fps/output-type */
 static int mode = 2; //0-640; 1-256; 2-384
 static int fps = 60;
 static int pWidth = 0;
 static int pHeight = 0;
 static int type = 16;
+static int raw_type = 0;
 static int debug = 1;
+static int async_ctrl = 0;
+static int verify = RS300_VERIFY_OFF;
+static int standby = RS300_STANDBY_OFF;
 module_param(mode, int, 0644);
+MODULE_PARM_DESC(mode, "Default mode: 0=640x512, 1=256x192, 2=384x288");
 module_param(fps, int, 0644);
+MODULE_PARM_DESC(fps, "Default frame rate (25, 30, 50 or 60)");
 module_param(pWidth, int, 0644);
 module_param(pHeight, int, 0644);
 module_param(type, int, 0644);
+MODULE_PARM_DESC(type, "Default output type sent in the stream start command");
+module_param(raw_type, int, 0644);
+MODULE_PARM_DESC(raw_type, "Default output type sent in the stream start command for raw Y16 output, 0 to disable Y16");
 module_param(debug, int, 0644);
 MODULE_PARM_DESC(debug, "Debug level (0-1)");
+module_param(async_ctrl, int, 0644);
+MODULE_PARM_DESC(async_ctrl, "Apply camera controls from a worker instead of blocking VIDIOC_S_CTRL (0-1)");
+module_param(verify, int, 0644);
+MODULE_PARM_DESC(verify, "Read back parameters after setting them: 0=off, 1=sampled, 2=always");
+module_param(standby, int, 0644);
+MODULE_PARM_DESC(standby, "Keep the camera streaming between STREAMON calls: 0=off, 1=after stream-off, 2=also from probe");
 
 /*
  * rs300 register definitions
@@ -153,28 +246,215 @@ struct ioctl_data{
 #define VCMD_ERR_STS_HW_ERR					0x0C
 #define VCMD_ERR_STS_UNKNOWN_SUBCMD_ERR		0x10
 #define VCMD_ERR_STS_PARAM_ERR				0x14
+/* Both codes past PARAM_ERR report a failed CRC check */
+#define VCMD_ERR_STS_CRC_ERR				0x18
+#define VCMD_ERR_STS_CRC_ERR_2				0x1C
+
+/*
+ * Command mailbox poll profiles
+ *
+ * Commands complete in very different times depending on what they do, so
+ * status polling is tuned per command class: the first status read comes
+ * after first_us, later reads back off exponentially up to max_us and the
+ * command is abandoned once timeout_ms has passed.
+ */
+enum rs300_vcmd_class {
+	RS300_VCMD_IMAGE,	/* Image processing parameters */
+	RS300_VCMD_FFC,		/* Shutter calibration */
+	RS300_VCMD_VIDEO,	/* MIPI output and preview start/stop */
+	RS300_VCMD_SYS,		/* Device information */
+	RS300_VCMD_FLASH,	/* Saving parameters to flash */
+	RS300_VCMD_NUM_CLASSES
+};
+
+struct rs300_vcmd_profile {
+	const char *name;
+	unsigned int first_us;
+	unsigned int max_us;
+	unsigned int timeout_ms;
+};
+
+static const struct rs300_vcmd_profile rs300_vcmd_profiles[RS300_VCMD_NUM_CLASSES] = {
+	[RS300_VCMD_IMAGE] = { "image", 2000, 50000, 1000 },
+	[RS300_VCMD_FFC]   = { "ffc", 50000, 250000, 5000 },
+	[RS300_VCMD_VIDEO] = { "video", 5000, 100000, 4500 },
+	[RS300_VCMD_SYS]   = { "sys", 2000, 50000, 500 },
+	[RS300_VCMD_FLASH] = { "flash", 50000, 250000, 10000 },
+};
+
+#define RS300_VCMD_MIN_POLL_US		500
+
+/* Time the camera needs to apply a parameter before it reads back */
+#define RS300_VERIFY_SETTLE_MS		100
+#define RS300_VERIFY_INTERVAL_DEFAULT	8
+
+/* Measured completion times, used to place the first status poll */
+struct rs300_vcmd_stats {
+	u32 count;
+	u32 errors;
+	u32 timeouts;
+	u32 crc_errors;	/* Commands the camera rejected with a CRC error */
+	u32 last_us;
+	u32 max_us;
+	u32 avg_us;	/* Running average, 1/8 weight per sample */
+};
+
+/* CRC16-CCITT (polynomial 0x1021, initial value 0), one entry per byte value */
+static const u16 rs300_crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
 
-static unsigned short do_crc(unsigned char *ptr, int len)
+static unsigned short do_crc(const unsigned char *ptr, int len)
 {
-    unsigned int i;
     unsigned short crc = 0x0000;
-    
-    while(len--)
-    {
-        crc ^= (unsigned short)(*ptr++) << 8;
-        for (i = 0; i < 8; ++i)
-        {
-            if (crc & 0x8000)
-                crc = (crc << 1) ^ 0x1021;
-            else
-                crc <<= 1;
-        }
-    }
-    
+
+    while (len--)
+        crc = (crc << 8) ^ rs300_crc16_table[((crc >> 8) ^ *ptr++) & 0xff];
+
     return crc;
 }
 
-static  u8 start_regs[] = {
+/*
+ * Camera command descriptors. Each entry is the 18 byte command as it goes
+ * on the wire: class, module index, subcmd, reserved, 12 parameter bytes
+ * and the CRC16 (low byte first). Constant commands carry their CRC in the
+ * template; for the rest the value is written to byte @param and the CRC
+ * is recomputed.
+ */
+#define RS300_VCMD_LEN			18
+#define RS300_VCMD_RESULT_MAX		40
+
+/*
+ * Camera processing parameters mirrored in the shadow cache, in control
+ * units. The camera takes zoom as level * 10.
+ */
+enum rs300_param {
+	RS300_PARAM_NONE,
+	RS300_PARAM_BRIGHTNESS,
+	RS300_PARAM_CONTRAST,
+	RS300_PARAM_DDE,
+	RS300_PARAM_SPATIAL_NR,
+	RS300_PARAM_TEMPORAL_NR,
+	RS300_PARAM_SCENE_MODE,
+	RS300_PARAM_COLORMAP,
+	RS300_PARAM_ZOOM,
+	RS300_NUM_PARAMS
+};
+
+struct rs300_param_desc {
+	const char *name;
+	u32 ctrl_id;
+	u8 scale;
+};
+
+static const struct rs300_param_desc rs300_params[RS300_NUM_PARAMS] = {
+	[RS300_PARAM_BRIGHTNESS]	= { "brightness", V4L2_CID_BRIGHTNESS, 1 },
+	[RS300_PARAM_CONTRAST]		= { "contrast", V4L2_CID_CONTRAST, 1 },
+	[RS300_PARAM_DDE]		= { "DDE", V4L2_CID_CUSTOM_BASE + 4, 1 },
+	[RS300_PARAM_SPATIAL_NR]	= { "spatial NR", V4L2_CID_CUSTOM_BASE + 5, 1 },
+	[RS300_PARAM_TEMPORAL_NR]	= { "temporal NR", V4L2_CID_CUSTOM_BASE + 6, 1 },
+	[RS300_PARAM_SCENE_MODE]	= { "scene mode", V4L2_CID_CUSTOM_BASE + 3, 1 },
+	[RS300_PARAM_COLORMAP]		= { "colormap", V4L2_CID_CUSTOM_BASE + 1, 1 },
+	[RS300_PARAM_ZOOM]		= { "zoom", V4L2_CID_ZOOM_ABSOLUTE, 10 },
+};
+
+enum rs300_cmd {
+	RS300_CMD_GET_BRIGHTNESS,
+	RS300_CMD_SET_BRIGHTNESS,
+	RS300_CMD_SET_CONTRAST,
+	RS300_CMD_SET_DDE,
+	RS300_CMD_SET_SPATIAL_NR,
+	RS300_CMD_SET_TEMPORAL_NR,
+	RS300_CMD_SET_SCENE_MODE,
+	RS300_CMD_GET_COLORMAP,
+	RS300_CMD_SET_COLORMAP,
+	RS300_CMD_SET_ZOOM,
+	RS300_CMD_FFC,
+	RS300_CMD_SET_MIPI,
+	RS300_CMD_GET_DEVICE_NAME,
+	RS300_NUM_CMDS
+};
+
+struct rs300_vcmd_desc {
+	const char *name;
+	enum rs300_vcmd_class profile;
+	enum rs300_param shadow;	/* parameter set or read, if any */
+	u8 param;		/* byte taking the value, 0 for constant commands */
+	u8 min;
+	u8 max;
+	u8 result_len;		/* receipt bytes read back, 0 for none */
+	u8 tmpl[RS300_VCMD_LEN];
+};
+
+#define RS300_VCMD(_name, _prof, _shadow, _param, _min, _max, _res, ...)	\
+	{ .name = _name, .profile = _prof, .shadow = _shadow,		\
+	  .param = _param,						\
+	  .min = _min, .max = _max, .result_len = _res,		\
+	  .tmpl = { __VA_ARGS__ } }
+
+static const struct rs300_vcmd_desc rs300_vcmds[RS300_NUM_CMDS] = {
+	[RS300_CMD_GET_BRIGHTNESS] = RS300_VCMD("get brightness", RS300_VCMD_IMAGE, RS300_PARAM_BRIGHTNESS, 0, 0, 0, 18,
+		0x10, 0x04, 0x87, 0x00, 0x01, [12] = 0x01, [16] = 0x01, 0xea),
+	[RS300_CMD_SET_BRIGHTNESS] = RS300_VCMD("brightness", RS300_VCMD_IMAGE, RS300_PARAM_BRIGHTNESS, 4, 0, 100, 0,
+		0x10, 0x04, 0x47),
+	[RS300_CMD_SET_CONTRAST] = RS300_VCMD("contrast", RS300_VCMD_IMAGE, RS300_PARAM_CONTRAST, 4, 0, 100, 0,
+		0x10, 0x04, 0x4a),
+	[RS300_CMD_SET_DDE] = RS300_VCMD("DDE", RS300_VCMD_IMAGE, RS300_PARAM_DDE, 4, 0, 100, 0,
+		0x10, 0x04, 0x45),
+	[RS300_CMD_SET_SPATIAL_NR] = RS300_VCMD("spatial NR", RS300_VCMD_IMAGE, RS300_PARAM_SPATIAL_NR, 4, 0, 100, 0,
+		0x10, 0x04, 0x4b),
+	[RS300_CMD_SET_TEMPORAL_NR] = RS300_VCMD("temporal NR", RS300_VCMD_IMAGE, RS300_PARAM_TEMPORAL_NR, 4, 0, 100, 0,
+		0x10, 0x04, 0x4c),
+	[RS300_CMD_SET_SCENE_MODE] = RS300_VCMD("scene mode", RS300_VCMD_IMAGE, RS300_PARAM_SCENE_MODE, 4, 0, 9, 0,
+		0x10, 0x04, 0x42),
+	[RS300_CMD_GET_COLORMAP] = RS300_VCMD("get colormap", RS300_VCMD_IMAGE, RS300_PARAM_COLORMAP, 0, 0, 0, 18,
+		0x10, 0x03, 0x85, [12] = 0x01, [16] = 0x21, 0x67),
+	[RS300_CMD_SET_COLORMAP] = RS300_VCMD("colormap", RS300_VCMD_IMAGE, RS300_PARAM_COLORMAP, 5, 0, 11, 0,
+		0x10, 0x03, 0x45),
+	/* Zoom is sent as level * 10 */
+	[RS300_CMD_SET_ZOOM] = RS300_VCMD("zoom", RS300_VCMD_IMAGE, RS300_PARAM_ZOOM, 5, 10, 80, 0,
+		0x01, 0x31, 0x42),
+	[RS300_CMD_FFC] = RS300_VCMD("shutter calibration", RS300_VCMD_FFC, RS300_PARAM_NONE, 0, 0, 0, 0,
+		0x10, 0x02, 0x43, [16] = 0xcf, 0xc8),
+	/* Enable, MIPI progressive, fps */
+	[RS300_CMD_SET_MIPI] = RS300_VCMD("fps", RS300_VCMD_VIDEO, RS300_PARAM_NONE, 6, 25, 60, 0,
+		0x10, 0x10, 0x46, 0x00, 0x01, 0x03),
+	[RS300_CMD_GET_DEVICE_NAME] = RS300_VCMD("get device name", RS300_VCMD_SYS, RS300_PARAM_NONE, 0, 0, 0, 40,
+		0x01, 0x01, 0x81, 0x00, 0x01, [12] = 0x20, [16] = 0xfc, 0x1e),
+};
+
+static const u8 start_regs[] = {
 		0x01, 0x30, 0xc1, 0x00,
 		0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00,
@@ -190,13 +470,14 @@ static  u8 start_regs[] = {
 		0x00, 0x00
 };
 
-static  u8 stop_regs[]={
+/* Size, fps and both CRCs are filled in by rs300_build_stop_cmd() */
+static const u8 stop_regs[]={
 		0x01, 0x30, 0xc2, 0x00,
 		0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00,
 		0x0a, 0x00,
 		0x00, 0x00, //crc [16]
-		0x2F, 0x0D, //crc [18]
+		0x00, 0x00, //crc [18]
 		0x01, //path
 		0x16, //src
 		0x00, //dst
@@ -207,81 +488,20 @@ static  u8 stop_regs[]={
     
 };
 
-static int read_regs(struct i2c_client *client,  u32 reg, u8 *val ,int len )
-{
-	struct i2c_msg msg[2];
-	unsigned char data[4] = { 0, 0, 0, 0 };
-    int ret;
-
-	msg[0].addr = client->addr;
-	msg[0].flags = 0;
-	msg[0].len = 2;
-	msg[0].buf = data;
-
-	msg[1].addr = client->addr;
-	msg[1].flags = 1;
-	msg[1].len = len;
-	msg[1].buf = val;
-	/* High byte goes out first */
-	data[0] = reg>>8;
-	data[1] = reg&0xff;
-    
-    ret = i2c_transfer(client->adapter, msg, 2);
-    if (ret != 2) {
-        dev_err(&client->dev, "i2c read error at reg 0x%04x: %d\n", reg, ret);
-        return ret < 0 ? ret : -EIO;
-    }
-    
-    return 0;
-}
-
-static int write_regs(struct i2c_client *client,  u32 reg, u8 *val,int len)
-{
-	struct i2c_msg msg[1];
-	unsigned char *outbuf = (unsigned char *)kmalloc(sizeof(unsigned char)*(len+2), GFP_KERNEL);
-    int ret;
-
-    if (!outbuf) {
-        dev_err(&client->dev, "Failed to allocate memory for I2C write\n");
-        return -ENOMEM;
-    }
-
-	msg->addr = client->addr;
-	msg->flags = 0;
-	msg->len = len+2;
-	msg->buf = outbuf;
-	outbuf[0] = reg>>8;
-    outbuf[1] = reg&0xff;
-	memcpy(outbuf+2, val, len);
-    
-    ret = i2c_transfer(client->adapter, msg, 1);
-    if (ret != 1) {
-        dev_err(&client->dev, "i2c write error at reg 0x%04x: %d\n", reg, ret);
-        kfree(outbuf);
-        return ret < 0 ? ret : -EIO;
-    }
-    
-    kfree(outbuf);
-    return 0;
-	// if (reg & I2C_VD_CHECK_ACCESS){
-	// 	return ret;
-	// }else
-	// {
-	// 	return check_access_done(client,2000);//命令超时控制，由于应用层已经控制这里不需要了
-	// }
-}
-
 enum pad_types {
 	IMAGE_PAD,
 	METADATA_PAD,
 	NUM_PADS
 };
 
+#define RS300_MAX_MODE_FPS	2
+
 struct rs300_mode {
 	unsigned int width;
 	unsigned int height;
 	struct v4l2_fract max_fps;
 	u32 code;
+	u8 fps[RS300_MAX_MODE_FPS];	/* Frame rates the module offers, ascending */
 };
 
 struct pll_ctrl_reg {
@@ -297,12 +517,90 @@ static const char * const rs300_supply_names[] = {
 
 #define rs300_NUM_SUPPLIES ARRAY_SIZE(rs300_supply_names)
 
-static const u32 codes[] = {
-	/* YUV 4:2:2 Formats*/
-	MEDIA_BUS_FMT_YUYV8_1X16,
-	MEDIA_BUS_FMT_UYVY8_1X16,
-	MEDIA_BUS_FMT_YUYV8_2X8,
-	MEDIA_BUS_FMT_UYVY8_2X8,
+/* Stream start/stop commands carry a path/src/dst/fps/size payload */
+#define RS300_STREAM_CFG_LEN	10
+
+/* Phases of stream-on, timed for log_status and sysfs */
+enum rs300_stream_phase {
+	RS300_STREAM_FPS,
+	RS300_STREAM_START,
+	RS300_STREAM_SETTLE,
+	RS300_STREAM_PARAMS,
+	RS300_STREAM_NUM_PHASES
+};
+
+static const char * const rs300_stream_phase_names[RS300_STREAM_NUM_PHASES] = {
+	[RS300_STREAM_FPS]	= "fps",
+	[RS300_STREAM_START]	= "start",
+	[RS300_STREAM_SETTLE]	= "settle",
+	[RS300_STREAM_PARAMS]	= "params",
+};
+
+#define RS300_DEVICE_NAME_LEN	32
+
+/*
+ * Camera state for the frame being captured, built from what the driver
+ * already knows so reading it costs no I2C traffic. Little endian.
+ */
+struct rs300_frame_meta {
+	__le32 stream_ms;	/* Time since stream-on */
+	__le16 flags;		/* RS300_META_* */
+	u8 fps;
+	u8 colormap;
+	u8 scene_mode;
+	u8 brightness;
+	u8 contrast;
+	u8 zoom;
+	__le32 ctrl_seq;	/* Image parameter changes the camera has taken */
+	__le64 ctrl_time_ns;	/* CLOCK_MONOTONIC when it acknowledged the last */
+} __packed;
+
+#define RS300_META_STREAMING	BIT(0)
+#define RS300_META_FFC		BIT(1)	/* Shutter closed for calibration */
+#define RS300_META_CMD_ERROR	BIT(2)	/* Last camera command failed */
+#define RS300_META_STANDBY	BIT(3)
+
+/* Image freeze after the calibration command has been acknowledged */
+#define RS300_FFC_SETTLE_MS	500
+
+enum rs300_ffc_reason {
+	RS300_FFC_MANUAL,	/* ffc_trigger button */
+	RS300_FFC_SCHEDULED,	/* FFC interval elapsed while streaming */
+	RS300_FFC_IDLE,		/* Run while not streaming */
+};
+
+/* Power management */
+#define RS300_AUTOSUSPEND_DELAY_MS	5000
+#define RS300_BOOT_TIMEOUT_MS		5000	/* Power-on to mailbox ready */
+#define RS300_BOOT_POLL_MS		20
+
+/* Control writes waiting for the control worker */
+#define RS300_CTRL_QUEUE_LEN	16
+
+struct rs300_ctrl_cmd {
+	u32 id;
+	s32 val;
+	s32 prev;	/* Value the camera keeps if the command fails */
+};
+
+struct rs300_format {
+	u32 code;
+	u8 bpp;
+	bool raw;	/* Pre-colormap intensity, sent with the raw output type */
+};
+
+/*
+ * Output the camera actually sends over MIPI. The YUV 4:2:2 stream is
+ * always Y0 U Y1 V; the byte order is fixed in camera firmware and the
+ * start command has no field to change it, so UYVY is not offered.
+ * Both YUV bus codes describe the same CSI-2 YUV422 8-bit data. Y16 is
+ * the 16-bit intensity before the colormap, one sample per pixel, so it
+ * needs the same bandwidth as YUV.
+ */
+static const struct rs300_format rs300_formats[] = {
+	{ MEDIA_BUS_FMT_YUYV8_2X8, 16, false },
+	{ MEDIA_BUS_FMT_YUYV8_1X16, 16, false },
+	{ MEDIA_BUS_FMT_Y16_1X16, 16, true },
 };
 
 struct rs300 {
@@ -321,6 +619,11 @@ struct rs300 {
 	/* V4L2 Controls */
 	struct v4l2_ctrl *pixel_rate;
 	struct v4l2_ctrl *link_frequency;
+
+	/* From the endpoint: link rates the module can use, and data lanes */
+	s64 link_freqs[RS300_MAX_LINK_FREQS];
+	unsigned int num_link_freqs;
+	unsigned int lanes;
 	struct v4l2_ctrl *brightness;
 	struct v4l2_ctrl *shutter_cal;  /* Shutter calibration button */
 	struct v4l2_ctrl *colormap;  /* Colormap selection control */
@@ -331,8 +634,19 @@ struct rs300 {
 	struct v4l2_ctrl *spatial_nr;
 	struct v4l2_ctrl *temporal_nr;
 
-	/* Current mode */
+	/* Camera-side initialisation, deferred from probe */
+	struct work_struct init_work;
+	struct completion init_done;
+
+	/* Reported by the camera, empty until identified */
+	char device_name[RS300_DEVICE_NAME_LEN];
+
+	/* Current mode, and the supported_modes the attached module can run */
 	const struct rs300_mode *mode;
+	unsigned long mode_mask;
+	int fps;
+	int type;		/* Output source selector sent in the start command */
+	int raw_type;		/* ...when streaming raw Y16 */
 
 	/*
 	 * Mutex for serialized access:
@@ -340,8 +654,86 @@ struct rs300 {
 	 */
 	struct mutex mutex;
 
+	/* Serialises use of the camera command mailbox */
+	struct mutex cmd_lock;
+	struct rs300_vcmd_stats vcmd_stats[RS300_VCMD_NUM_CLASSES];
+
+	/* Asynchronous control application */
+	bool async_ctrls;
+	bool ctrl_reverting;
+	struct workqueue_struct *ctrl_wq;
+	struct work_struct ctrl_work;
+	spinlock_t ctrl_queue_lock;
+	struct rs300_ctrl_cmd ctrl_queue[RS300_CTRL_QUEUE_LEN];
+	unsigned int ctrl_queue_head;
+	unsigned int ctrl_queue_len;
+	u32 ctrl_coalesced;	/* Intermediate values dropped by coalescing */
+
+	/* Post-set read back */
+	u8 verify_policy;
+	u32 verify_interval;
+	atomic_t verify_writes;
+	atomic_t verify_checks;
+	atomic_t verify_mismatches;
+	atomic_t verify_failures;
+	bool ctrl_batch;		/* Applying a control cluster */
+	unsigned long verify_batch;	/* Read back when the batch is done */
+
+	/* Last value the camera acknowledged or reported, per parameter */
+	s32 shadow[RS300_NUM_PARAMS];
+	unsigned long shadow_valid;
+	/* Parameters set while not streaming, sent at the next stream-on */
+	unsigned long desired_dirty;
+	/* Parameters the driver has changed, restored after a power cycle */
+	unsigned long params_written;
+	struct v4l2_ctrl *param_ctrls[RS300_NUM_PARAMS];
+
+	/* DMA safe I2C transfer buffers, protected by cmd_lock */
+	u8 *xfer_tx;
+	u8 *xfer_rx;
+
+	/* Runtime PM resume: power-on until the camera answers */
+	u32 resume_count;
+	u32 resume_last_us;
+	u32 resume_max_us;
+
 	/* Streaming on/off */
 	bool streaming;
+	bool video_running;	/* Camera is sending frames */
+	u8 standby;
+	bool armed;		/* Running while not streaming; holds a PM ref */
+	int mipi_fps;		/* Frame rate last programmed, 0 if unknown */
+	u8 start_cmd[RS300_VCMD_LEN + RS300_STREAM_CFG_LEN];	/* Last built */
+	bool start_cmd_valid;
+	u32 stream_on_us[RS300_STREAM_NUM_PHASES];	/* Last stream-on */
+	ktime_t stream_start;
+
+	/* Frame metadata */
+	ktime_t ffc_until;	/* Calibration in progress until then */
+	bool cmd_failed;	/* Outcome of the last camera command */
+	atomic_t ctrl_seq;
+	u64 ctrl_time_ns;
+
+	/* Shutter calibration scheduling */
+	struct delayed_work ffc_work;
+	struct delayed_work ffc_end_work;
+	u32 ffc_interval;	/* Seconds, 0 for manual only */
+	ktime_t ffc_defer_until;
+	bool ffc_on_stop;
+	u32 ffc_count;
+	u32 ffc_failed;
+	u8 ffc_reason;		/* Of the calibration waiting to settle */
+	int ffc_ret;
+	bool ffc_stopped;	/* Suspending or removing, don't re-arm */
+	spinlock_t ffc_lock;	/* Calibration state and arming the works */
+
+	/* Imaging profiles */
+	s32 profiles[RS300_NUM_PROFILES][RS300_NUM_PARAMS];
+	unsigned long profiles_valid;
+	/* Firmware command storing the current parameters, from the DT */
+	u8 save_cmd[RS300_VCMD_LEN];
+	bool has_save_cmd;
+	u32 persist_count;
 };
 
 static struct rs300_mode supported_modes[] = {
@@ -353,24 +745,27 @@ static struct rs300_mode supported_modes[] = {
             .denominator = 1,
         },
         .code = MEDIA_BUS_FMT_YUYV8_2X8,
+        .fps = { 30, 60 },
     },
     { /* 256*/ // MIPI video not currently working, but I2C commands are working
         .width      = 256,
         .height     = 192,  
         .max_fps = {
-            .numerator = 25,
+            .numerator = 50,
             .denominator = 1,
         },
         .code = MEDIA_BUS_FMT_YUYV8_2X8,
+        .fps = { 25, 50 },
     },
         { /* 384*/
         .width      = 384,
         .height     = 288,  
         .max_fps = {
-            .numerator = 30,
+            .numerator = 60,
             .denominator = 1,
         },
         .code = MEDIA_BUS_FMT_YUYV8_2X8,
+        .fps = { 30, 60 },
     }
 
 };
@@ -380,30 +775,227 @@ static inline struct rs300 *to_rs300(struct v4l2_subdev *sd)
 	return container_of(sd, struct rs300, sd);
 }
 
-static u32 rs300_get_format_code(struct rs300 *rs300, u32 code)
+/* Wait for the camera-side part of probe to finish */
+static int rs300_wait_init(struct rs300 *rs300)
+{
+	return wait_for_completion_killable(&rs300->init_done);
+}
+
+/* The @index-th mode the attached module supports, or NULL */
+static const struct rs300_mode *rs300_enum_mode(struct rs300 *rs300,
+						unsigned int index)
 {
 	unsigned int i;
 
-	lockdep_assert_held(&rs300->mutex);	
+	for_each_set_bit(i, &rs300->mode_mask, ARRAY_SIZE(supported_modes))
+		if (!index--)
+			return &supported_modes[i];
 
-	for (i = 0; i < ARRAY_SIZE(codes); i++)
-		if (codes[i] == code)
-			break;
+	return NULL;
+}
+
+static bool rs300_mode_has_fps(const struct rs300_mode *mode, int fps)
+{
+	unsigned int i;
+
+	for (i = 0; i < RS300_MAX_MODE_FPS; i++)
+		if (mode->fps[i] && mode->fps[i] == fps)
+			return true;
+
+	return false;
+}
+
+/* Frame rate of @mode closest to @fps */
+static int rs300_mode_nearest_fps(const struct rs300_mode *mode, int fps)
+{
+	int best = mode->fps[0];
+	unsigned int i;
+
+	for (i = 1; i < RS300_MAX_MODE_FPS && mode->fps[i]; i++)
+		if (abs(mode->fps[i] - fps) < abs(best - fps))
+			best = mode->fps[i];
+
+	return best;
+}
+
+/* Supported mode closest to @width x @height, as v4l2_find_nearest_size() */
+static const struct rs300_mode *rs300_find_mode(struct rs300 *rs300,
+						u32 width, u32 height)
+{
+	const struct rs300_mode *best = rs300->mode;
+	u32 dist, best_dist = U32_MAX;
+	unsigned int i;
+
+	for_each_set_bit(i, &rs300->mode_mask, ARRAY_SIZE(supported_modes)) {
+		dist = abs((int)supported_modes[i].width - (int)width) +
+		       abs((int)supported_modes[i].height - (int)height);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = &supported_modes[i];
+		}
+	}
+
+	return best;
+}
+
+/*
+ * I2C transport. Register address and data go through per-device buffers
+ * allocated at probe, so no command or status poll allocates memory and
+ * the buffers can be handed to the adapter as DMA safe. Callers hold
+ * cmd_lock, which owns the buffers.
+ */
+static int read_regs(struct rs300 *rs300, u32 reg, u8 *val, int len)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	struct i2c_msg msg[2];
+	int ret;
+
+	lockdep_assert_held(&rs300->cmd_lock);
+
+	if (len > I2C_VD_BUFFER_DATA_LEN)
+		return -EINVAL;
+
+	/* High byte goes out first */
+	rs300->xfer_tx[0] = reg >> 8;
+	rs300->xfer_tx[1] = reg & 0xff;
+
+	msg[0].addr = client->addr;
+	msg[0].flags = I2C_M_DMA_SAFE;
+	msg[0].len = 2;
+	msg[0].buf = rs300->xfer_tx;
+
+	msg[1].addr = client->addr;
+	msg[1].flags = I2C_M_RD | I2C_M_DMA_SAFE;
+	msg[1].len = len;
+	msg[1].buf = rs300->xfer_rx;
+
+	ret = i2c_transfer(client->adapter, msg, 2);
+	if (ret != 2) {
+		dev_err_ratelimited(&client->dev, "i2c read error at reg 0x%04x: %d\n", reg, ret);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	if (val != rs300->xfer_rx)
+		memcpy(val, rs300->xfer_rx, len);
+	return 0;
+}
+
+static int write_regs(struct rs300 *rs300, u32 reg, const u8 *val, int len)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	struct i2c_msg msg;
+	int ret;
+
+	lockdep_assert_held(&rs300->cmd_lock);
+
+	if (len > I2C_VD_BUFFER_DATA_LEN)
+		return -EINVAL;
+
+	rs300->xfer_tx[0] = reg >> 8;
+	rs300->xfer_tx[1] = reg & 0xff;
+	memcpy(rs300->xfer_tx + 2, val, len);
+
+	msg.addr = client->addr;
+	msg.flags = I2C_M_DMA_SAFE;
+	msg.len = len + 2;
+	msg.buf = rs300->xfer_tx;
+
+	ret = i2c_transfer(client->adapter, &msg, 1);
+	if (ret != 1) {
+		dev_err(&client->dev, "i2c write error at reg 0x%04x: %d\n", reg, ret);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	return 0;
+}
+
+static const struct rs300_format *rs300_find_format(u32 code)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rs300_formats); i++)
+		if (rs300_formats[i].code == code)
+			return &rs300_formats[i];
+
+	return NULL;
+}
+
+/* Raw output needs the firmware's output type, 0 if none is configured */
+static bool rs300_format_usable(struct rs300 *rs300,
+				const struct rs300_format *format)
+{
+	return !format->raw || rs300->raw_type;
+}
+
+/* Codes the camera cannot send fall back to the first one it can */
+static u32 rs300_get_format_code(struct rs300 *rs300, u32 code)
+{
+	const struct rs300_format *format = rs300_find_format(code);
+
+	lockdep_assert_held(&rs300->mutex);
+
+	if (!format || !rs300_format_usable(rs300, format))
+		code = rs300_formats[0].code;
+
+	return code;
+}
+
+/*
+ * Lowest link frequency that carries the active mode at the current frame
+ * rate. Frequencies are DDR, so each lane moves two bits per clock.
+ */
+static unsigned int rs300_link_freq_index(struct rs300 *rs300, u8 bpp)
+{
+	u64 needed = (u64)rs300->mode->width * rs300->mode->height *
+		     rs300->fps * bpp;
+	unsigned int i, fastest = 0;
+	int best = -1;
+
+	for (i = 0; i < rs300->num_link_freqs; i++) {
+		if (rs300->link_freqs[i] > rs300->link_freqs[fastest])
+			fastest = i;
+		if ((u64)rs300->link_freqs[i] * 2 * rs300->lanes < needed)
+			continue;
+		if (best < 0 || rs300->link_freqs[i] < rs300->link_freqs[best])
+			best = i;
+	}
+
+	/* Nothing is fast enough, use the fastest there is */
+	return best < 0 ? fastest : best;
+}
 
-	if (i >= ARRAY_SIZE(codes))
-		i = 0;	
+/* Report the link frequency and pixel rate for the active mode and rate */
+static void rs300_update_link_freq(struct rs300 *rs300)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	const struct rs300_format *format = rs300_find_format(rs300->fmt.code);
+	u8 bpp = format ? format->bpp : 16;
+	unsigned int idx;
+	s64 rate;
+
+	lockdep_assert_held(&rs300->mutex);
+
+	if (!rs300->link_frequency || !rs300->pixel_rate)
+		return;
 
-	return codes[i];
+	idx = rs300_link_freq_index(rs300, bpp);
+	rate = div_u64(rs300->link_freqs[idx] * 2 * rs300->lanes, bpp);
+
+	__v4l2_ctrl_s_ctrl(rs300->link_frequency, idx);
+	__v4l2_ctrl_modify_range(rs300->pixel_rate, rate, rate, 1, rate);
+
+	dev_dbg(&client->dev, "%ux%u at %d fps: link %lld Hz, pixel rate %lld",
+		rs300->mode->width, rs300->mode->height, rs300->fps,
+		rs300->link_freqs[idx], rate);
 }
 
 static long rs300_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct rs300 *rs300 = to_rs300(sd);
+	struct ioctl_data *valp = arg;
 	long ret = 0;
-	unsigned char *data;
-	struct ioctl_data * valp;
 
-	valp=(struct ioctl_data *)arg;
 	if((cmd==CMD_GET)||(cmd==CMD_SET)){
 		if((valp!=NULL) &&(valp->data!=NULL) ){
 			dev_info(&client->dev,"rs300 %d %d %d  \n",cmd, valp->wIndex,valp->wLength);
@@ -411,33 +1003,56 @@ static long rs300_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 			dev_err(&client->dev, "rs300 args error \n");
 			return -EFAULT;
 		}
+		if (valp->wLength > I2C_VD_BUFFER_DATA_LEN)
+			return -EINVAL;
 	}
-	switch (cmd) {
 
-	case CMD_GET:
-		data = kmalloc(valp->wLength, GFP_KERNEL);
-		read_regs(client,valp->wIndex,data,valp->wLength);
+	if (cmd == CMD_GET || cmd == CMD_SET) {
+		ret = pm_runtime_resume_and_get(&client->dev);
+		if (ret < 0)
+			return ret;
+	}
 
-		if (copy_to_user(valp->data, data, valp->wLength))
+	/*
+	 * Raw access shares the mailbox with driver commands. The receive
+	 * buffer doubles as the bounce buffer for the user data.
+	 */
+	switch (cmd) {
+	case CMD_GET:
+		mutex_lock(&rs300->cmd_lock);
+		ret = read_regs(rs300, valp->wIndex, rs300->xfer_rx, valp->wLength);
+		if (!ret && copy_to_user(valp->data, rs300->xfer_rx, valp->wLength))
 		{
 			ret = -EFAULT;
 			dev_err(&client->dev, "error stop rs300\n");
 		}
-		kfree(data);                                                                                                                                               
+		mutex_unlock(&rs300->cmd_lock);
 		break;
 	case CMD_SET:
-		write_regs(client,valp->wIndex,valp->data,valp->wLength);
+		mutex_lock(&rs300->cmd_lock);
+		if (copy_from_user(rs300->xfer_rx, valp->data, valp->wLength))
+			ret = -EFAULT;
+		else
+			ret = write_regs(rs300, valp->wIndex, rs300->xfer_rx, valp->wLength);
+		mutex_unlock(&rs300->cmd_lock);
 		break;
 	default:
-		ret = -ENOIOCTLCMD;
-		break;
+		return -ENOIOCTLCMD;
 	}
 
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_put_autosuspend(&client->dev);
+
 	return ret;
 }
 static void rs300_reset_colorspace(struct v4l2_mbus_framefmt *fmt)
 {
-	fmt->colorspace = V4L2_COLORSPACE_SRGB;
+	const struct rs300_format *format = rs300_find_format(fmt->code);
+
+	if (format && format->raw)
+		fmt->colorspace = V4L2_COLORSPACE_RAW;
+	else
+		fmt->colorspace = V4L2_COLORSPACE_SRGB;
 	fmt->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt->colorspace);
 	fmt->quantization = V4L2_MAP_QUANTIZATION_DEFAULT(false,
 							  fmt->colorspace,
@@ -454,15 +1069,12 @@ static void rs300_set_default_format(struct rs300 *rs300)
     
     /* Initialize the default format */
     fmt = &rs300->fmt;
-    fmt->code = supported_modes[mode].code;
-    fmt->width = supported_modes[mode].width;
-    fmt->height = supported_modes[mode].height;
+    fmt->code = rs300->mode->code;
+    fmt->width = rs300->mode->width;
+    fmt->height = rs300->mode->height;
     fmt->field = V4L2_FIELD_NONE;
     rs300_reset_colorspace(fmt);
     
-    /* Set the default mode */
-    rs300->mode = &supported_modes[mode];
-    
     dev_info(&client->dev, "Default format set: code=0x%x, %dx%d",
         fmt->code, fmt->width, fmt->height);
 }	
@@ -475,1139 +1087,1122 @@ static int rs300_set_test_pattern(struct rs300 *rs300, int value)
 	return 0;
 }
 
-///////////////////// TODO: Reduce repeditive code for functions that send commands to the camera ///////////////////////
+static const char *rs300_vcmd_strerror(u8 error_code)
+{
+	switch (error_code) {
+	case 0x00:
+		return "Correct";
+	case 0x01:
+		return "Length";
+	case 0x02:
+		return "Unknown instruction";
+	case 0x03:
+		return "Hardware error";
+	case 0x04:
+		return "Unknown instruction (not yet enabled)";
+	case VCMD_ERR_STS_PARAM_ERR >> 2:
+		return "Parameter error";
+	case VCMD_ERR_STS_CRC_ERR >> 2:
+	case VCMD_ERR_STS_CRC_ERR_2 >> 2:
+		return "CRC check error";
+	default:
+		return "Unknown error code";
+	}
+}
 
-/* Function to get the current brightness value from the camera */
-static int rs300_get_brightness(struct rs300 *rs300, int *brightness_value)
+/*
+ * rs300_vcmd_exec - run one command through the camera command mailbox
+ *
+ * Writes @cmd to the command buffer, waits for the busy bit in the status
+ * register to clear and, if @result is given, reads @result_len bytes of
+ * receipt back from the command buffer. The first status read is placed
+ * just ahead of the class' measured completion time and later reads back
+ * off exponentially until the class deadline expires.
+ */
+static int rs300_vcmd_exec(struct rs300 *rs300, enum rs300_vcmd_class cls,
+			   const u8 *cmd, int len, u8 *result, int result_len)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    u8 result_buffer[18];  /* Buffer to hold the result data */
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Getting current brightness value from camera");
-    
-    /* Construct the command buffer for GET brightness based on the example */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x04;  /* Module Command Index */
-    cmd_buffer[2] = 0x87;  /* SubCmd - 0x87 for GET brightness */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = 0x01;  /* Parameter 1 - Based on your example */
-    cmd_buffer[5] = 0x00;
-    cmd_buffer[6] = 0x00;
-    cmd_buffer[7] = 0x00;
-    cmd_buffer[8] = 0x00;
-    cmd_buffer[9] = 0x00;
-    cmd_buffer[10] = 0x00;
-    cmd_buffer[11] = 0x00;
-    cmd_buffer[12] = 0x01;  /* Parameter 9 - Based on your example */
-    cmd_buffer[13] = 0x00;
-    cmd_buffer[14] = 0x00;
-    cmd_buffer[15] = 0x00;
-    
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Get brightness command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* STEP 1: Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write get brightness command: %d", ret);
-        return ret;
-    }
-    
-    /* STEP 2: Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(200);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Get brightness command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  /* Bits 2-7 */
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Get brightness command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
-        
-        /* Check for errors */
-        if (has_failed) {
-            /* Bit 1 set: Command execution failed */
-            dev_err(&client->dev, "Get brightness command execution failed with error code: 0x%02X", error_code);
-            
-            /* Interpret error code */
-            switch (error_code) {
-            case 0x00:
-                dev_info(&client->dev, "Error: Correct");
-                break;
-            case 0x01:
-                dev_err(&client->dev, "Error: Length");
-                break;
-            case 0x02:
-                dev_err(&client->dev, "Error: Unknown instruction");
-                break;
-            case 0x03:
-                dev_err(&client->dev, "Error: Hardware error");
-                break;
-            case 0x04:
-                dev_err(&client->dev, "Error: Unknown instruction (not yet enabled)");
-                break;
-            case 0x05:
-            case 0x06:
-            case 0x07:
-                dev_err(&client->dev, "Error: CRC check error");
-                break;
-            default:
-                dev_err(&client->dev, "Error: Unknown error code");
-                break;
-            }
-            
-            return -EIO;
-        }
-        
-        /* Even if not failed, check if there's an error code */
-        if (error_code != 0) {
-            dev_warn(&client->dev, "Get brightness command completed but with error code: 0x%02X", error_code);
-        }
-        
-        /* STEP 3: Command executed successfully, now read the result from 0x1d00 */
-        ret = read_regs(client, 0x1d00, result_buffer, sizeof(result_buffer));
-        if (ret) {
-            dev_err(&client->dev, "Failed to read brightness result: %d", ret);
-            return ret;
-        }
-        
-        dev_info(&client->dev, "Brightness result buffer: %*ph", (int)sizeof(result_buffer), result_buffer);
-        
-        /* Based on the command structure, the brightness value should be in byte 4 */
-        *brightness_value = result_buffer[4];
-        
-        dev_info(&client->dev, "Current brightness value: %d (0x%02X)", *brightness_value, *brightness_value);
-        return 0;
-    }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Get brightness command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	const struct rs300_vcmd_profile *prof = &rs300_vcmd_profiles[cls];
+	struct rs300_vcmd_stats *stats = &rs300->vcmd_stats[cls];
+	unsigned int delay_us;
+	ktime_t start, deadline;
+	u32 elapsed_us;
+	u8 status;
+	int ret;
+
+	dev_dbg(&client->dev, "%s command: %*ph", prof->name, len, cmd);
+
+	mutex_lock(&rs300->cmd_lock);
+
+	ret = write_regs(rs300, I2C_VD_BUFFER_RW, cmd, len);
+	if (ret)
+		goto out;
+
+	start = ktime_get();
+	deadline = ktime_add_ms(start, prof->timeout_ms);
+
+	if (stats->count)
+		delay_us = stats->avg_us - stats->avg_us / 4;
+	else
+		delay_us = prof->first_us;
+	delay_us = clamp_t(unsigned int, delay_us, RS300_VCMD_MIN_POLL_US,
+			   prof->max_us);
+
+	for (;;) {
+		fsleep(delay_us);
+
+		ret = read_regs(rs300, I2C_VD_BUFFER_STATUS, &status, 1);
+		if (ret)
+			goto out;
+
+		if (!(status & VCMD_BUSY_STS_BIT))
+			break;
+
+		if (ktime_after(ktime_get(), deadline)) {
+			dev_err(&client->dev, "%s command %*ph timed out after %u ms",
+				prof->name, 3, cmd, prof->timeout_ms);
+			ret = -ETIMEDOUT;
+			goto out;
+		}
+
+		delay_us = min_t(unsigned int, delay_us * 2, prof->max_us);
+	}
+
+	elapsed_us = ktime_us_delta(ktime_get(), start);
+
+	if (status & VCMD_RST_STS_BIT) {
+		dev_err(&client->dev, "%s command %*ph failed: %s (0x%02X)",
+			prof->name, 3, cmd, rs300_vcmd_strerror(status >> 2),
+			status >> 2);
+		/* The camera checks our CRC; receipts carry none to check */
+		if ((status & VCMD_ERR_STS_BIT) == VCMD_ERR_STS_CRC_ERR ||
+		    (status & VCMD_ERR_STS_BIT) == VCMD_ERR_STS_CRC_ERR_2)
+			stats->crc_errors++;
+		ret = -EIO;
+		goto out;
+	}
+
+	stats->count++;
+	stats->last_us = elapsed_us;
+	stats->max_us = max(stats->max_us, elapsed_us);
+	if (stats->avg_us)
+		stats->avg_us = stats->avg_us - stats->avg_us / 8 + elapsed_us / 8;
+	else
+		stats->avg_us = elapsed_us;
+
+	if (result) {
+		ret = read_regs(rs300, I2C_VD_BUFFER_RW, result, result_len);
+		if (ret)
+			goto out;
+		dev_dbg(&client->dev, "%s receipt: %*ph", prof->name,
+			result_len, result);
+	}
+
+out:
+	if (ret) {
+		stats->errors++;
+		if (ret == -ETIMEDOUT)
+			stats->timeouts++;
+	}
+	WRITE_ONCE(rs300->cmd_failed, ret != 0);
+	mutex_unlock(&rs300->cmd_lock);
+	return ret;
+}
+
+/*
+ * rs300_vcmd_run - send a command from the descriptor table
+ *
+ * @value is ignored for constant commands. If the command has a receipt it
+ * is copied to @result, which must hold RS300_VCMD_RESULT_MAX bytes.
+ */
+static int rs300_vcmd_run(struct rs300 *rs300, enum rs300_cmd id, int value,
+			  u8 *result)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	const struct rs300_vcmd_desc *desc = &rs300_vcmds[id];
+	u8 cmd[RS300_VCMD_LEN];
+	unsigned short crc;
+	int ret;
+
+	memcpy(cmd, desc->tmpl, sizeof(cmd));
+
+	if (desc->param) {
+		if (value < desc->min || value > desc->max) {
+			dev_err(&client->dev, "Invalid %s value: %d (valid range: %d-%d)",
+				desc->name, value, desc->min, desc->max);
+			return -EINVAL;
+		}
+
+		cmd[desc->param] = value;
+		crc = do_crc(cmd, 16);
+		cmd[16] = crc & 0xFF;         /* Low byte of CRC first */
+		cmd[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
+	}
+
+	ret = rs300_vcmd_exec(rs300, desc->profile, cmd, sizeof(cmd),
+			      result, result ? desc->result_len : 0);
+	if (ret)
+		dev_err(&client->dev, "%s command failed: %d", desc->name, ret);
+
+	return ret;
+}
+
+static void rs300_shadow_store(struct rs300 *rs300, enum rs300_param param,
+			       s32 value)
+{
+	WRITE_ONCE(rs300->shadow[param], value);
+	set_bit(param, &rs300->shadow_valid);
+}
+
+static bool rs300_shadow_load(struct rs300 *rs300, enum rs300_param param,
+			      s32 *value)
+{
+	if (!test_bit(param, &rs300->shadow_valid))
+		return false;
+
+	*value = READ_ONCE(rs300->shadow[param]);
+	return true;
+}
+
+static enum rs300_param rs300_ctrl_to_param(u32 id)
+{
+	unsigned int i;
+
+	for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+		if (rs300_params[i].ctrl_id == id)
+			return i;
+
+	return RS300_PARAM_NONE;
+}
+
+/* GET commands return the value in byte 4 of the receipt */
+static int rs300_vcmd_get(struct rs300 *rs300, enum rs300_cmd id, int *value)
+{
+	enum rs300_param param = rs300_vcmds[id].shadow;
+	u8 result[RS300_VCMD_RESULT_MAX];
+	int ret;
+
+	ret = rs300_vcmd_run(rs300, id, 0, result);
+	if (ret)
+		return ret;
+
+	*value = result[4];
+	if (param) {
+		*value /= rs300_params[param].scale;
+		rs300_shadow_store(rs300, param, *value);
+	}
+
+	return 0;
+}
+
+static enum rs300_cmd rs300_param_get_cmd(enum rs300_param param)
+{
+	unsigned int i;
+
+	for (i = 0; i < RS300_NUM_CMDS; i++)
+		if (rs300_vcmds[i].shadow == param && !rs300_vcmds[i].param &&
+		    rs300_vcmds[i].result_len)
+			return i;
+
+	return RS300_NUM_CMDS;
+}
+
+static bool rs300_verify_due(struct rs300 *rs300)
+{
+	switch (rs300->verify_policy) {
+	case RS300_VERIFY_ALWAYS:
+		return true;
+	case RS300_VERIFY_SAMPLED:
+		return atomic_inc_return(&rs300->verify_writes) %
+		       rs300->verify_interval == 0;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Read a parameter back after setting it, if the camera can report it and
+ * the verification policy asks for it. A mismatch is counted and logged;
+ * the shadow cache keeps the value read back.
+ */
+static void rs300_verify_param(struct rs300 *rs300, enum rs300_param param,
+			       int value)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	int readback;
+	int ret;
+
+	ret = rs300_vcmd_get(rs300, rs300_param_get_cmd(param), &readback);
+	if (ret) {
+		atomic_inc(&rs300->verify_failures);
+		dev_warn(&client->dev, "Failed to read back %s: %d",
+			 rs300_params[param].name, ret);
+		return;
+	}
+
+	atomic_inc(&rs300->verify_checks);
+	if (readback != value) {
+		atomic_inc(&rs300->verify_mismatches);
+		dev_warn(&client->dev, "%s mismatch! Set: %d, Got: %d",
+			 rs300_params[param].name, value, readback);
+	}
+}
+
+/* Whether a write to @param is to be read back */
+static bool rs300_verify_wanted(struct rs300 *rs300, enum rs300_param param)
+{
+	return rs300_param_get_cmd(param) != RS300_NUM_CMDS &&
+	       rs300_verify_due(rs300);
+}
+
+static void rs300_vcmd_verify(struct rs300 *rs300, enum rs300_param param,
+			      int value)
+{
+	if (!rs300_verify_wanted(rs300, param))
+		return;
+
+	/* A batch waits once for the camera and checks everything after */
+	if (rs300->ctrl_batch) {
+		set_bit(param, &rs300->verify_batch);
+		return;
+	}
+
+	msleep(RS300_VERIFY_SETTLE_MS);
+	rs300_verify_param(rs300, param, value);
+}
+
+/* Read back the parameters a batch left for checking */
+static void rs300_verify_flush(struct rs300 *rs300)
+{
+	unsigned int i;
+	s32 value;
+
+	if (!rs300->verify_batch)
+		return;
+
+	msleep(RS300_VERIFY_SETTLE_MS);
+
+	for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+		if (test_and_clear_bit(i, &rs300->verify_batch) &&
+		    rs300_shadow_load(rs300, i, &value))
+			rs300_verify_param(rs300, i, value);
+}
+
+/* Record a parameter value, in control units, the camera has acknowledged */
+static void rs300_param_taken(struct rs300 *rs300, enum rs300_param param,
+			      int value)
+{
+	/*
+	 * Seen on the status poll, so the camera took the command up to one
+	 * poll interval earlier; when its image pipeline applies it is unknown.
+	 */
+	WRITE_ONCE(rs300->ctrl_time_ns, ktime_get_ns());
+	atomic_inc(&rs300->ctrl_seq);
+	rs300_shadow_store(rs300, param, value);
+	set_bit(param, &rs300->params_written);
+}
+
+/* SET command for a parameter */
+static enum rs300_cmd rs300_param_set_cmd(enum rs300_param param)
+{
+	unsigned int i;
+
+	for (i = 0; i < RS300_NUM_CMDS; i++)
+		if (rs300_vcmds[i].shadow == param && rs300_vcmds[i].param)
+			return i;
+
+	return RS300_NUM_CMDS;
+}
+
+/* Set a parameter, @value in control units, and record it in the shadow cache */
+static int rs300_vcmd_set(struct rs300 *rs300, enum rs300_cmd id, int value)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	enum rs300_param param = rs300_vcmds[id].shadow;
+	int scale = param ? rs300_params[param].scale : 1;
+	int ret;
+
+	dev_info(&client->dev, "Setting %s to %d", rs300_vcmds[id].name, value);
+
+	ret = rs300_vcmd_run(rs300, id, value * scale, NULL);
+	if (ret)
+		return ret;
+
+	if (param) {
+		rs300_param_taken(rs300, param, value);
+		rs300_vcmd_verify(rs300, param, value);
+	}
+
+	dev_info(&client->dev, "%s set successfully", rs300_vcmds[id].name);
+	return 0;
+}
+
+/*
+ * Re-read every parameter the camera can report back into the shadow cache.
+ * The remaining parameters are write-only and are only known once set.
+ */
+static int rs300_shadow_refresh(struct rs300 *rs300)
+{
+	unsigned int i;
+	int value;
+	int ret = 0;
+
+	for (i = 0; i < RS300_NUM_CMDS; i++) {
+		const struct rs300_vcmd_desc *desc = &rs300_vcmds[i];
+
+		if (desc->shadow && !desc->param && desc->result_len)
+			ret = rs300_vcmd_get(rs300, i, &value) ?: ret;
+	}
+
+	return ret;
+}
+
+/* Round 0-100 brightness up to the camera's steps of 10 */
+static int rs300_brightness_round(int brightness_value)
+{
+    return min(DIV_ROUND_UP(brightness_value, 10) * 10, 100);
+}
+
+static int rs300_brightness_correct(struct rs300 *rs300, int brightness_value)
+{
+    return rs300_vcmd_set(rs300, RS300_CMD_SET_BRIGHTNESS,
+                          rs300_brightness_round(brightness_value));
 }
 
-static int rs300_set_dde(struct rs300 *rs300, int value)
+static void rs300_ffc_event(struct rs300 *rs300, u32 type, u32 reason,
+			    int ret)
+{
+	struct v4l2_event ev = {
+		.type = type,
+	};
+
+	ev.u.data[0] = reason;
+	ev.u.data[1] = ret ? 1 : 0;	/* Calibration failed */
+
+	if (rs300->sd.devnode)
+		v4l2_event_queue(rs300->sd.devnode, &ev);
+}
+
+/*
+ * Calibrations run without rs300->mutex so controls stay usable while the
+ * shutter is closed. Their state and the arming of both works are under
+ * ffc_lock, so nothing is queued once suspend or remove has stopped it.
+ */
+static void rs300_ffc_queue(struct rs300 *rs300, struct delayed_work *work,
+			    unsigned long delay)
+{
+	spin_lock(&rs300->ffc_lock);
+	if (!rs300->ffc_stopped)
+		mod_delayed_work(rs300->ctrl_wq, work, delay);
+	spin_unlock(&rs300->ffc_lock);
+}
+
+static void rs300_ffc_stop(struct rs300 *rs300, bool stop)
+{
+	spin_lock(&rs300->ffc_lock);
+	rs300->ffc_stopped = stop;
+	spin_unlock(&rs300->ffc_lock);
+}
+
+/* Next scheduled calibration one interval from now */
+static void rs300_ffc_reschedule(struct rs300 *rs300)
+{
+	u32 interval = READ_ONCE(rs300->ffc_interval);
+
+	if (interval)
+		rs300_ffc_queue(rs300, &rs300->ffc_work,
+				msecs_to_jiffies(interval * MSEC_PER_SEC));
+	else
+		cancel_delayed_work(&rs300->ffc_work);
+}
+
+/*
+ * Run a shutter calibration. Subscribers get RS300_EVENT_FFC_START before
+ * the shutter closes and RS300_EVENT_FFC_END once the image has settled,
+ * so frames in between can be skipped.
+ */
+static int rs300_run_ffc(struct rs300 *rs300, enum rs300_ffc_reason reason)
+{
+	unsigned int settle_ms;
+	int ret;
+
+	rs300_ffc_event(rs300, RS300_EVENT_FFC_START, reason, 0);
+
+	/* Only the mailbox is held while the shutter is closed */
+	WRITE_ONCE(rs300->ffc_until, KTIME_MAX);
+	ret = rs300_vcmd_run(rs300, RS300_CMD_FFC, 0, NULL);
+	settle_ms = ret ? 0 : RS300_FFC_SETTLE_MS;
+	WRITE_ONCE(rs300->ffc_until, ktime_add_ms(ktime_get(), settle_ms));
+
+	spin_lock(&rs300->ffc_lock);
+	if (ret)
+		WRITE_ONCE(rs300->ffc_failed, rs300->ffc_failed + 1);
+	else
+		WRITE_ONCE(rs300->ffc_count, rs300->ffc_count + 1);
+
+	/* The shutter is already open again if the command failed */
+	rs300->ffc_reason = reason;
+	rs300->ffc_ret = ret;
+	spin_unlock(&rs300->ffc_lock);
+
+	rs300_ffc_queue(rs300, &rs300->ffc_end_work,
+			msecs_to_jiffies(settle_ms));
+	rs300_ffc_reschedule(rs300);
+
+	return ret;
+}
+
+static void rs300_ffc_end_work(struct work_struct *work)
+{
+	struct rs300 *rs300 = container_of(to_delayed_work(work), struct rs300,
+					   ffc_end_work);
+
+	u8 reason;
+	int ret;
+
+	spin_lock(&rs300->ffc_lock);
+	reason = rs300->ffc_reason;
+	ret = rs300->ffc_ret;
+	spin_unlock(&rs300->ffc_lock);
+
+	rs300_ffc_event(rs300, RS300_EVENT_FFC_END, reason, ret);
+}
+
+static void rs300_ffc_work(struct work_struct *work)
+{
+	struct rs300 *rs300 = container_of(to_delayed_work(work), struct rs300,
+					   ffc_work);
+	struct device *dev = rs300->sd.dev;
+	ktime_t defer = READ_ONCE(rs300->ffc_defer_until);
+	ktime_t now = ktime_get();
+
+	/* Inside a protected capture window, run as soon as it closes */
+	if (ktime_before(now, defer)) {
+		rs300_ffc_queue(rs300, &rs300->ffc_work,
+				msecs_to_jiffies(ktime_ms_delta(defer, now)) + 1);
+		return;
+	}
+
+	/*
+	 * Nothing to calibrate while the camera is powered down. A camera
+	 * still powered during the autosuspend delay, as after stream-off,
+	 * holds no usage reference but can be calibrated.
+	 */
+	if (pm_runtime_get_if_active(dev, true) <= 0) {
+		rs300_ffc_reschedule(rs300);
+		return;
+	}
+
+	rs300_run_ffc(rs300, READ_ONCE(rs300->streaming) ?
+			      RS300_FFC_SCHEDULED : RS300_FFC_IDLE);
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+}
+
+/* Send a camera command for a control; runs in s_ctrl or in the control worker */
+static int rs300_apply_ctrl(struct rs300 *rs300, u32 id, s32 val)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting DDE to %d", value);
-    
-    /* Validate value range */
-    if (value < 0 || value > 100) {
-        dev_err(&client->dev, "Invalid DDE value: %d (valid range: 0-100)", value);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x04;  /* Module Command Index */
-    cmd_buffer[2] = 0x45;  /* SubCmd */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = value; /* Parameter value */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = crc & 0xFF;
-    cmd_buffer[17] = (crc >> 8) & 0xFF;
-    
-    dev_info(&client->dev, "DDE command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write DDE command: %d", ret);
-        return ret;
-    }
-    
-    /* Wait for completion */
-    while (retry_count < max_retries) {
-        msleep(50);
-        
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read status: %d", ret);
-            return ret;
-        }
-        
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;
-        
-        if (!is_busy) {
-            if (has_failed) {
-                dev_err(&client->dev, "DDE command failed with error code: 0x%02X", error_code);
-                return -EIO;
-            }
-            dev_info(&client->dev, "DDE set successfully");
-            return 0;
+    int ret = 0;
+
+    switch (id) {
+    case V4L2_CID_TEST_PATTERN:
+        ret = rs300_set_test_pattern(rs300, val);
+        break;
+    case V4L2_CID_BRIGHTNESS:
+        ret = rs300_brightness_correct(rs300, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 1:
+        /* This is our colormap selection control */
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_COLORMAP, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 2:
+        /* This is our FFC (Flat Field Correction) button */
+        dev_info(&client->dev, "FFC trigger received\n");
+        if (val == 0) {
+            ret = rs300_run_ffc(rs300, RS300_FFC_MANUAL);
         }
-        
-        retry_count++;
+        break;
+    case V4L2_CID_ZOOM_ABSOLUTE:
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_ZOOM, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 3:
+        /* This is our scene mode selection control */
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_SCENE_MODE, val);
+        break;
+    case V4L2_CID_CONTRAST:
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_CONTRAST, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 4:  /* DDE */
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_DDE, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 5:  /* Spatial NR */
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_SPATIAL_NR, val);
+        break;
+    case V4L2_CID_CUSTOM_BASE + 6:  /* Temporal NR */
+        ret = rs300_vcmd_set(rs300, RS300_CMD_SET_TEMPORAL_NR, val);
+        break;
+    default:
+        dev_err(&client->dev, "Invalid control %d", id);
+        ret = -EINVAL;
     }
-    
-    dev_err(&client->dev, "DDE command timed out");
-    return -ETIMEDOUT;
+
+    return ret;
+}
+
+/* Controls that send a camera command and may be deferred to the worker */
+static bool rs300_ctrl_is_camera_cmd(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_BRIGHTNESS:
+	case V4L2_CID_CONTRAST:
+	case V4L2_CID_ZOOM_ABSOLUTE:
+	case V4L2_CID_CUSTOM_BASE + 1:
+	case V4L2_CID_CUSTOM_BASE + 2:
+	case V4L2_CID_CUSTOM_BASE + 3:
+	case V4L2_CID_CUSTOM_BASE + 4:
+	case V4L2_CID_CUSTOM_BASE + 5:
+	case V4L2_CID_CUSTOM_BASE + 6:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Queue a control write for the worker. A value control that still has a
+ * write pending is coalesced into it: only the newest value is sent, and
+ * the value the camera falls back to on failure stays that of the oldest.
+ */
+static int rs300_queue_ctrl(struct rs300 *rs300, struct v4l2_ctrl *ctrl)
+{
+	struct rs300_ctrl_cmd *cmd;
+	unsigned int i, tail;
+
+	spin_lock(&rs300->ctrl_queue_lock);
+	if (ctrl->type != V4L2_CTRL_TYPE_BUTTON) {
+		for (i = 0; i < rs300->ctrl_queue_len; i++) {
+			cmd = &rs300->ctrl_queue[(rs300->ctrl_queue_head + i) %
+						 RS300_CTRL_QUEUE_LEN];
+			if (cmd->id != ctrl->id)
+				continue;
+
+			cmd->val = ctrl->val;
+			rs300->ctrl_coalesced++;
+			spin_unlock(&rs300->ctrl_queue_lock);
+			return 0;
+		}
+	}
+
+	if (rs300->ctrl_queue_len == RS300_CTRL_QUEUE_LEN) {
+		spin_unlock(&rs300->ctrl_queue_lock);
+		return -EBUSY;
+	}
+
+	tail = (rs300->ctrl_queue_head + rs300->ctrl_queue_len) %
+	       RS300_CTRL_QUEUE_LEN;
+	cmd = &rs300->ctrl_queue[tail];
+	cmd->id = ctrl->id;
+	cmd->val = ctrl->val;
+	cmd->prev = ctrl->cur.val;
+	rs300->ctrl_queue_len++;
+	spin_unlock(&rs300->ctrl_queue_lock);
+
+	queue_work(rs300->ctrl_wq, &rs300->ctrl_work);
+	return 0;
 }
 
-static int rs300_set_contrast(struct rs300 *rs300, int value)
+static bool rs300_dequeue_ctrl(struct rs300 *rs300, struct rs300_ctrl_cmd *cmd)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting contrast to %d", value);
-    
-    /* Validate value range */
-    if (value < 0 || value > 100) {
-        dev_err(&client->dev, "Invalid contrast value: %d (valid range: 0-100)", value);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x04;  /* Module Command Index */
-    cmd_buffer[2] = 0x4A;  /* SubCmd */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = value; /* Parameter value */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = crc & 0xFF;
-    cmd_buffer[17] = (crc >> 8) & 0xFF;
-    
-    dev_info(&client->dev, "Contrast command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write contrast command: %d", ret);
-        return ret;
-    }
-    
-    /* Wait for completion */
-    while (retry_count < max_retries) {
-        msleep(50);
-        
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read status: %d", ret);
-            return ret;
-        }
-        
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;
-        
-        if (!is_busy) {
-            if (has_failed) {
-                dev_err(&client->dev, "Contrast command failed with error code: 0x%02X", error_code);
-                return -EIO;
-            }
-            dev_info(&client->dev, "Contrast set successfully");
-            return 0;
-        }
-        
-        retry_count++;
-    }
-    
-    dev_err(&client->dev, "Contrast command timed out");
-    return -ETIMEDOUT;
+	bool found = false;
+
+	spin_lock(&rs300->ctrl_queue_lock);
+	if (rs300->ctrl_queue_len) {
+		*cmd = rs300->ctrl_queue[rs300->ctrl_queue_head];
+		rs300->ctrl_queue_head = (rs300->ctrl_queue_head + 1) %
+					 RS300_CTRL_QUEUE_LEN;
+		rs300->ctrl_queue_len--;
+		found = true;
+	}
+	spin_unlock(&rs300->ctrl_queue_lock);
+
+	return found;
 }
 
-static int rs300_set_spatial_nr(struct rs300 *rs300, int value)
+/*
+ * A failed command leaves the camera at @prev. If a newer command for the
+ * same control is still queued, hand @prev on to it and let it report.
+ */
+static bool rs300_ctrl_pass_prev(struct rs300 *rs300, u32 id, s32 prev)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting spatial noise reduction to %d", value);
-    
-    /* Validate value range */
-    if (value < 0 || value > 100) {
-        dev_err(&client->dev, "Invalid spatial NR value: %d (valid range: 0-100)", value);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x04;  /* Module Command Index */
-    cmd_buffer[2] = 0x4B;  /* SubCmd */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = value; /* Parameter value */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = crc & 0xFF;
-    cmd_buffer[17] = (crc >> 8) & 0xFF;
-    
-    dev_info(&client->dev, "Spatial NR command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write spatial NR command: %d", ret);
-        return ret;
-    }
-    
-    /* Wait for completion */
-    while (retry_count < max_retries) {
-        msleep(50);
-        
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read status: %d", ret);
-            return ret;
-        }
-        
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;
-        
-        if (!is_busy) {
-            if (has_failed) {
-                dev_err(&client->dev, "Spatial NR command failed with error code: 0x%02X", error_code);
-                return -EIO;
-            }
-            dev_info(&client->dev, "Spatial NR set successfully");
-            return 0;
-        }
-        
-        retry_count++;
-    }
-    
-    dev_err(&client->dev, "Spatial NR command timed out");
-    return -ETIMEDOUT;
+	unsigned int i, idx;
+	bool found = false;
+
+	spin_lock(&rs300->ctrl_queue_lock);
+	for (i = 0; i < rs300->ctrl_queue_len; i++) {
+		idx = (rs300->ctrl_queue_head + i) % RS300_CTRL_QUEUE_LEN;
+		if (rs300->ctrl_queue[idx].id == id) {
+			rs300->ctrl_queue[idx].prev = prev;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&rs300->ctrl_queue_lock);
+
+	return found;
 }
 
-static int rs300_set_temporal_nr(struct rs300 *rs300, int value)
+/*
+ * Report the outcome of an asynchronous control with RS300_EVENT_CTRL_DONE,
+ * as the V4L2_EVENT_CTRL sent when the write was accepted only means it
+ * was queued. On failure the control is also restored to the value the
+ * camera still holds.
+ */
+static void rs300_ctrl_complete(struct rs300 *rs300,
+				const struct rs300_ctrl_cmd *cmd, int ret)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting temporal noise reduction to %d", value);
-    
-    /* Validate value range */
-    if (value < 0 || value > 100) {
-        dev_err(&client->dev, "Invalid temporal NR value: %d (valid range: 0-100)", value);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x04;  /* Module Command Index */
-    cmd_buffer[2] = 0x4C;  /* SubCmd */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = value; /* Parameter value */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = crc & 0xFF;
-    cmd_buffer[17] = (crc >> 8) & 0xFF;
-    
-    dev_info(&client->dev, "Temporal NR command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write temporal NR command: %d", ret);
-        return ret;
-    }
-    
-    /* Wait for completion */
-    while (retry_count < max_retries) {
-        msleep(50);
-        
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read status: %d", ret);
-            return ret;
-        }
-        
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;
-        
-        if (!is_busy) {
-            if (has_failed) {
-                dev_err(&client->dev, "Temporal NR command failed with error code: 0x%02X", error_code);
-                return -EIO;
-            }
-            dev_info(&client->dev, "Temporal NR set successfully");
-            return 0;
-        }
-        
-        retry_count++;
-    }
-    
-    dev_err(&client->dev, "Temporal NR command timed out");
-    return -ETIMEDOUT;
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	struct rs300_ctrl_done done = {
+		.id = cmd->id,
+		.value = ret ? cmd->prev : cmd->val,
+		.error = ret,
+	};
+	struct v4l2_event ev = {
+		.type = RS300_EVENT_CTRL_DONE,
+		.id = cmd->id,
+	};
+	struct v4l2_ctrl *ctrl;
+
+	lockdep_assert_held(&rs300->mutex);
+
+	ctrl = v4l2_ctrl_find(&rs300->ctrl_handler, cmd->id);
+	if (!ctrl)
+		return;
+
+	if (ret) {
+		dev_err(&client->dev, "Control 0x%x = %d failed: %d",
+			cmd->id, cmd->val, ret);
+
+		/* A newer write for the control will report instead */
+		if (ctrl->type != V4L2_CTRL_TYPE_BUTTON &&
+		    rs300_ctrl_pass_prev(rs300, cmd->id, cmd->prev))
+			return;
+
+		/* Volatile controls read back from the shadow cache instead */
+		if (ctrl->type != V4L2_CTRL_TYPE_BUTTON &&
+		    !(ctrl->flags & V4L2_CTRL_FLAG_VOLATILE)) {
+			rs300->ctrl_reverting = true;
+			__v4l2_ctrl_s_ctrl(ctrl, cmd->prev);
+			rs300->ctrl_reverting = false;
+		}
+	}
+
+	memcpy(ev.u.data, &done, sizeof(done));
+	if (rs300->sd.devnode)
+		v4l2_event_queue(rs300->sd.devnode, &ev);
 }
 
-static int rs300_get_colormap(struct rs300 *rs300, int *colormap_value)
+/*
+ * Send a queued write holding only the mailbox, so control ioctls are not
+ * held up while the camera works. The acknowledged value is recorded under
+ * rs300->mutex; read-back needs neither lock. Calibrations take their own.
+ */
+static int rs300_apply_queued(struct rs300 *rs300,
+			      const struct rs300_ctrl_cmd *cmd)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    u8 result_buffer[18];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    int current_colormap;
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;             /* Command Class */
-    cmd_buffer[1] = 0x03;             /* Module Command Index */
-    cmd_buffer[2] = 0x85;             /* SubCmd */
-    // 9 bytes of 0x00
-    memset(&cmd_buffer[3], 0x00, 9);
-    cmd_buffer[12] = 0x01;
-    cmd_buffer[13] = 0x00;
-    cmd_buffer[14] = 0x00;
-    cmd_buffer[15] = 0x00;
-
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* STEP 1: Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write command: %d", ret);
-        return ret;
-    }
+	enum rs300_param param = rs300_ctrl_to_param(cmd->id);
+	s32 value = cmd->val;
+	int ret;
 
-    /* STEP 2: Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  // Bits 2-7
-
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
+	if (!param)
+		return rs300_apply_ctrl(rs300, cmd->id, cmd->val);
 
-        /* Check for errors */
-        if (has_failed) {
-            dev_err(&client->dev, "Command execution failed with error code: 0x%02X", error_code);
-            return -EIO;
-        }
-        
-        /* STEP 3: Command executed successfully, now read the result from 0x1d00 */
-        ret = read_regs(client, 0x1d00, result_buffer, sizeof(result_buffer));
-        if (ret) {
-            dev_err(&client->dev, "Failed to read colormap result: %d", ret);
-            return ret;
-        }
-        
-        /* Based on the command structure, the colormap value should be in byte 4 */
-        *colormap_value = result_buffer[4];
-        
-        dev_info(&client->dev, "Current colormap value: %d (0x%02X)", *colormap_value, *colormap_value);
-        return 0;
-    }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Get colormap command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+	if (param == RS300_PARAM_BRIGHTNESS)
+		value = rs300_brightness_round(value);
+
+	ret = rs300_vcmd_run(rs300, rs300_param_set_cmd(param),
+			     value * rs300_params[param].scale, NULL);
+	if (ret)
+		return ret;
 
+	mutex_lock(&rs300->mutex);
+	rs300_param_taken(rs300, param, value);
+	mutex_unlock(&rs300->mutex);
+
+	if (rs300_verify_wanted(rs300, param)) {
+		msleep(RS300_VERIFY_SETTLE_MS);
+		rs300_verify_param(rs300, param, value);
+	}
+
+	return 0;
 }
 
-static int rs300_set_colormap(struct rs300 *rs300, int colormap_value)
+static void rs300_ctrl_work(struct work_struct *work)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    int current_colormap;
-    
-    dev_info(&client->dev, "Setting colormap to %d", colormap_value);
-    
-    /* Validate colormap value range */
-    if (colormap_value < 0 || colormap_value > 11) {
-        dev_err(&client->dev, "Invalid colormap value: %d (valid range: 0-11)",
-                colormap_value);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;             /* Command Class */
-    cmd_buffer[1] = 0x03;             /* Module Command Index */
-    cmd_buffer[2] = 0x45;             /* SubCmd */
-    cmd_buffer[3] = 0x00;             /* Reserved */
-    cmd_buffer[4] = 0x00;             /* Parameter 1 (0x00) */
-    cmd_buffer[5] = colormap_value;   /* Parameter 2 (0-11) */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[6], 0, 10);
-    
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* STEP 1: Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write command: %d", ret);
-        return ret;
-    }
-    
-    /* STEP 2: Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  // Bits 2-7
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
-        
-        /* Check for errors */
-        if (has_failed) {
-            /* Bit 1 set: Command execution failed */
-            dev_err(&client->dev, "Command execution failed with error code: 0x%02X", error_code);
-            
-            /* Interpret error code */
-            switch (error_code) {
-            case 0x00:
-                dev_info(&client->dev, "Error: Correct");
-                break;
-            case 0x01:
-                dev_err(&client->dev, "Error: Length");
-                break;
-            case 0x02:
-                dev_err(&client->dev, "Error: Unknown instruction");
-                break;
-            case 0x03:
-                dev_err(&client->dev, "Error: Hardware error");
-                break;
-            case 0x04:
-                dev_err(&client->dev, "Error: Unknown instruction (not yet enabled)");
-                break;
-            case 0x05:
-            case 0x06:
-            case 0x07:
-                dev_err(&client->dev, "Error: CRC check error");
-                break;
-            default:
-                dev_err(&client->dev, "Error: Unknown error code");
-                break;
-            }
-            
-            return -EIO;
-        }
-        
-        /* After successful command execution */
-        if (!has_failed && error_code == 0) {
-            /* Wait a moment before getting the colormap */
-            msleep(100);
-            
-            /* Get the current colormap to verify the change */
-            ret = rs300_get_colormap(rs300, &current_colormap);
-            if (ret) {
-                dev_warn(&client->dev, "Failed to get current colormap: %d", ret);
-            } else {
-                if (current_colormap == colormap_value) {
-                    dev_info(&client->dev, "Colormap successfully set and verified: %d", current_colormap);
-                } else {
-                    dev_warn(&client->dev, "Colormap mismatch! Set: %d, Got: %d", 
-                             colormap_value, current_colormap);
-                }
-            }
-        }
-        
-        return 0;
-    }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+	struct rs300 *rs300 = container_of(work, struct rs300, ctrl_work);
+	struct device *dev = rs300->sd.dev;
+	struct rs300_ctrl_cmd cmd;
+	int pm_ret;
+	int ret;
+
+	/* Keep the camera powered until the queue is drained */
+	pm_ret = pm_runtime_resume_and_get(dev);
+
+	while (rs300_dequeue_ctrl(rs300, &cmd)) {
+		ret = pm_ret < 0 ? pm_ret : rs300_apply_queued(rs300, &cmd);
+
+		mutex_lock(&rs300->mutex);
+		rs300_ctrl_complete(rs300, &cmd, ret);
+		mutex_unlock(&rs300->mutex);
+	}
+
+	if (pm_ret >= 0) {
+		pm_runtime_mark_last_busy(dev);
+		pm_runtime_put_autosuspend(dev);
+	}
 }
 
-static int rs300_shutter_cal(struct rs300 *rs300)
+/*
+ * Send the parameters in @mask with values from @vals. The mailbox takes
+ * one command at a time, so they are sent back to back under a single
+ * power reference with one shared settle before read-back. If one fails,
+ * the ones already sent are put back to the control values and the whole
+ * set is rejected.
+ */
+static int rs300_write_params(struct rs300 *rs300, unsigned long mask,
+                              const s32 *vals)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-	int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Triggering shutter calibration (FFC)");
-    
-    /* Construct the command buffer based on the example (shutter command) */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x02;  /* Module Command Index */
-    cmd_buffer[2] = 0x43;  /* SubCmd - 0x43 for shutter/FFC */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[4], 0, 12);
-
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Shutter command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* STEP 1: Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write shutter command: %d", ret);
-        return ret;
-    }
-    
-    /* STEP 2: Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing - FFC might take longer */
-        msleep(1000);  /* Longer wait time for FFC */
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Shutter command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  // Bits 2-7
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Shutter command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
-        
-        /* Check for errors */
-        if (has_failed) {
-            /* Bit 1 set: Command execution failed */
-            dev_err(&client->dev, "Shutter command execution failed with error code: 0x%02X", error_code);
-            
-            /* Interpret error code */
-            switch (error_code) {
-            case 0x00:
-                dev_info(&client->dev, "Error: Correct");
-                break;
-            case 0x01:
-                dev_err(&client->dev, "Error: Length");
-                break;
-            case 0x02:
-                dev_err(&client->dev, "Error: Unknown instruction");
-                break;
-            case 0x03:
-                dev_err(&client->dev, "Error: Hardware error");
-                break;
-            case 0x04:
-                dev_err(&client->dev, "Error: Unknown instruction (not yet enabled)");
-                break;
-            case 0x05:
-            case 0x06:
-            case 0x07:
-                dev_err(&client->dev, "Error: CRC check error");
-                break;
-            default:
-                dev_err(&client->dev, "Error: Unknown error code");
-                break;
-            }
-            
-            return -EIO;
-        }
-        
-        /* Even if not failed, check if there's an error code */
-        if (error_code != 0) {
-            dev_warn(&client->dev, "Shutter command completed but with error code: 0x%02X", error_code);
-        }
-        
-        /* Command executed successfully */
-        dev_info(&client->dev, "Shutter calibration command executed successfully");
+    unsigned long applied = 0;
+    struct v4l2_ctrl *ctrl;
+    unsigned int i;
+    s32 value;
+    int ret = 0;
+
+    /* Parameters only need to reach the camera once it streams */
+    if (!rs300->streaming) {
+        rs300->desired_dirty |= mask;
         return 0;
     }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Shutter command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
-}
 
-static int rs300_brightness_correct(struct rs300 *rs300, int brightness_value)
-{
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 brightness_param;
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    int current_brightness;
-    
-    /* Map 0-100 brightness to appropriate parameter values */
-    if (brightness_value == 0)
-        brightness_param = 0x00;
-    else if (brightness_value <= 10)
-        brightness_param = 0x0A;
-    else if (brightness_value <= 20)
-        brightness_param = 0x14;
-    else if (brightness_value <= 30)
-        brightness_param = 0x1E;
-    else if (brightness_value <= 40)
-        brightness_param = 0x28;
-    else if (brightness_value <= 50)
-        brightness_param = 0x32;
-    else if (brightness_value <= 60)
-        brightness_param = 0x3C;
-    else if (brightness_value <= 70)
-        brightness_param = 0x46;
-    else if (brightness_value <= 80)
-        brightness_param = 0x50;
-    else if (brightness_value <= 90)
-        brightness_param = 0x5A;
-    else
-        brightness_param = 0x64;
-    
-    dev_info(&client->dev, "Setting brightness correctly to %d (param: 0x%02X)", 
-             brightness_value, brightness_param);
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;             /* Command Class */
-    cmd_buffer[1] = 0x04;             /* Module Command Index */
-    cmd_buffer[2] = 0x47;             /* SubCmd */
-    cmd_buffer[3] = 0x00;             /* Reserved */
-    cmd_buffer[4] = brightness_param; /* Parameter 1 (brightness) */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* STEP 1: Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write command: %d", ret);
+    ret = pm_runtime_resume_and_get(&client->dev);
+    if (ret < 0)
         return ret;
-    }
-    
-    /* STEP 2: Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  // Bits 2-7
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Command is busy, retrying...");
-            retry_count++;
+
+    rs300->ctrl_batch = true;
+
+    for_each_set_bit(i, &mask, RS300_NUM_PARAMS) {
+        if (rs300_shadow_load(rs300, i, &value) && value == vals[i])
             continue;
+
+        ret = rs300_apply_ctrl(rs300, rs300_params[i].ctrl_id, vals[i]);
+        if (ret)
+            break;
+        __set_bit(i, &applied);
+    }
+
+    rs300->ctrl_batch = false;
+
+    if (ret) {
+        rs300->verify_batch = 0;
+        for_each_set_bit(i, &applied, RS300_NUM_PARAMS) {
+            ctrl = rs300->param_ctrls[i];
+            if (rs300_apply_ctrl(rs300, ctrl->id, ctrl->cur.val))
+                dev_warn(&client->dev, "Failed to restore %s",
+                         rs300_params[i].name);
         }
-        
-        /* Check for errors */
-        if (has_failed) {
-            /* Bit 1 set: Command execution failed */
-            dev_err(&client->dev, "Command execution failed with error code: 0x%02X", error_code);
-            
-            /* Interpret error code */
-            switch (error_code) {
-            case 0x00:
-                dev_info(&client->dev, "Error: Correct");
-                break;
-            case 0x01:
-                dev_err(&client->dev, "Error: Length");
-                break;
-            case 0x02:
-                dev_err(&client->dev, "Error: Unknown instruction");
-                break;
-            case 0x03:
-                dev_err(&client->dev, "Error: Hardware error");
-                break;
-            case 0x04:
-                dev_err(&client->dev, "Error: Unknown instruction (not yet enabled)");
-                break;
-            case 0x05:
-            case 0x06:
-            case 0x07:
-                dev_err(&client->dev, "Error: CRC check error");
-                break;
-            default:
-                dev_err(&client->dev, "Error: Unknown error code");
-                break;
-            }
-            
-            return -EIO;
-        }
-        
-        /* After successful command execution */
-        if (!has_failed && error_code == 0) {
-            /* Wait a moment before getting the brightness */
-            msleep(100);
-            
-            /* Get the current brightness to verify the change */
-            ret = rs300_get_brightness(rs300, &current_brightness);
-            if (ret) {
-                dev_warn(&client->dev, "Failed to get current brightness: %d", ret);
-            } else {
-                if (current_brightness == brightness_param) {
-                    dev_info(&client->dev, "Brightness successfully set and verified: %d", current_brightness);
-                } else {
-                    dev_warn(&client->dev, "Brightness mismatch! Set: 0x%02X, Got: 0x%02X", 
-                             brightness_param, current_brightness);
-                }
-            }
-        }
-        
-        return 0;
+    } else {
+        rs300_verify_flush(rs300);
     }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
+
+    return ret;
 }
 
-/* Add new function to handle zoom setting */
-///TODO: Reduce fix zoom function. Trying to link to v4l2 zoom control but encountering issues.
-static int rs300_set_zoom(struct rs300 *rs300, int zoom_level)
+/*
+ * The image parameters form one control cluster, so a VIDIOC_S_EXT_CTRLS
+ * carrying several of them is handled here in one call.
+ */
+static int rs300_set_params(struct rs300 *rs300, struct v4l2_ctrl *master)
 {
-    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
+    s32 vals[RS300_NUM_PARAMS];
+    enum rs300_param param;
+    unsigned long mask = 0;
+    struct v4l2_ctrl *ctrl;
+    unsigned int i;
     int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting zoom to %dx", zoom_level);
-    
-    /* Validate zoom level */
-    if (zoom_level < 1 || zoom_level > 8) {
-        dev_err(&client->dev, "Invalid zoom level: %d (valid range: 1-8)", zoom_level);
-        return -EINVAL;
-    }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x01;  /* Fixed value */
-    cmd_buffer[1] = 0x31;  /* Fixed value */
-    cmd_buffer[2] = 0x42;  /* Fixed value */
-    cmd_buffer[3] = 0x00;  /* Fixed value */
-    cmd_buffer[4] = 0x00;  /* Fixed value */
-    cmd_buffer[5] = zoom_level * 10;  /* Convert zoom level to command value */
-    /* Fill remaining values */
-    memset(&cmd_buffer[6], 0x00, 10);  /* Bytes 6-15 are 0x00 */
-    cmd_buffer[16] = 0x06;  /* Fixed value */
-    cmd_buffer[17] = 0x0A;  /* Fixed value */
-    
-    dev_info(&client->dev, "Zoom command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write zoom command: %d", ret);
-        return ret;
-    }
-    
-    /* Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Zoom command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  /* Bits 2-7 */
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Zoom command is busy, retrying...");
-            retry_count++;
+
+    for (i = 0; i < master->ncontrols; i++) {
+        ctrl = master->cluster[i];
+        if (!ctrl || !ctrl->is_new)
+            continue;
+
+        /* Queued commands report back one by one */
+        if (rs300->async_ctrls && rs300->streaming) {
+            ret = rs300_queue_ctrl(rs300, ctrl);
+            if (ret)
+                return ret;
             continue;
         }
-        
-        /* Check for errors */
-        if (has_failed) {
-            dev_err(&client->dev, "Zoom command execution failed with error code: 0x%02X", error_code);
-            return -EIO;
-        }
-        
-        /* Command executed successfully */
-        dev_info(&client->dev, "Zoom set to %dx successfully", zoom_level);
-        return 0;
+
+        param = rs300_ctrl_to_param(ctrl->id);
+        vals[param] = ctrl->val;
+        __set_bit(param, &mask);
     }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Zoom command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+
+    return rs300_write_params(rs300, mask, vals);
 }
 
-static int rs300_set_scene_mode(struct rs300 *rs300, int scene_mode_value)
+/* Load a stored profile as one parameter batch */
+static int rs300_load_profile(struct rs300 *rs300, unsigned int idx)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
+    unsigned long mask = 0;
+    unsigned int i;
     int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Setting scene mode to %d", scene_mode_value);
-    
-    /* Validate scene mode value range */
-    if (scene_mode_value < 0 || scene_mode_value > 9) {
-        dev_err(&client->dev, "Invalid scene mode value: %d (valid range: 0-9)",
-                scene_mode_value);
+
+    if (!test_bit(idx, &rs300->profiles_valid)) {
+        dev_err(&client->dev, "Profile %s has not been saved",
+                profile_menu[idx]);
         return -EINVAL;
     }
-    
-    /* Construct the command buffer */
-    cmd_buffer[0] = 0x10;             /* Command Class */
-    cmd_buffer[1] = 0x04;             /* Module Command Index */
-    cmd_buffer[2] = 0x42;             /* SubCmd */
-    cmd_buffer[3] = 0x00;             /* Reserved */
-    cmd_buffer[4] = scene_mode_value;  /* Parameter 1 (scene mode value) */
-    
-    /* Fill remaining parameters with zeros */
-    memset(&cmd_buffer[5], 0, 11);
-    
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "Scene mode command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-    if (ret) {
-        dev_err(&client->dev, "Failed to write scene mode command: %d", ret);
+
+    for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+        if (rs300->param_ctrls[i])
+            __set_bit(i, &mask);
+
+    ret = rs300_write_params(rs300, mask, rs300->profiles[idx]);
+    if (ret)
         return ret;
+
+    /* Bring the controls in line without sending anything again */
+    rs300->ctrl_reverting = true;
+    for_each_set_bit(i, &mask, RS300_NUM_PARAMS)
+        __v4l2_ctrl_s_ctrl(rs300->param_ctrls[i], rs300->profiles[idx][i]);
+    rs300->ctrl_reverting = false;
+
+    return 0;
+}
+
+static void rs300_save_profile(struct rs300 *rs300, unsigned int idx)
+{
+    unsigned int i;
+
+    for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+        rs300->profiles[idx][i] = rs300->param_ctrls[i] ?
+                                  rs300->param_ctrls[i]->cur.val : 0;
+    set_bit(idx, &rs300->profiles_valid);
+}
+
+static void rs300_sync_params(struct rs300 *rs300);
+
+/*
+ * Store the parameters in the camera's flash so it powers up with them.
+ * The camera saves what it holds, so deferred parameters go out first.
+ */
+static int rs300_persist_params(struct rs300 *rs300)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    int ret;
+
+    ret = pm_runtime_resume_and_get(&client->dev);
+    if (ret < 0)
+        return ret;
+
+    rs300_sync_params(rs300);
+    if (rs300->desired_dirty) {
+        dev_err(&client->dev, "Parameters not applied, not saving");
+        ret = -EIO;
+    } else {
+        ret = rs300_vcmd_exec(rs300, RS300_VCMD_FLASH, rs300->save_cmd,
+                              sizeof(rs300->save_cmd), NULL, 0);
+        if (!ret)
+            rs300->persist_count++;
     }
-    
-    /* Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Scene mode command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  /* Bits 2-7 */
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Scene mode command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
-        
-        /* Check for errors */
-        if (has_failed) {
-            dev_err(&client->dev, "Scene mode command execution failed with error code: 0x%02X", error_code);
-            return -EIO;
-        }
-        
-        /* Command executed successfully */
-        dev_info(&client->dev, "Scene mode set successfully");
-        return 0;
-    }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Scene mode command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
+
+    return ret;
 }
 
+/* Warm standby, defined with the stream operations */
+static int rs300_arm(struct rs300 *rs300);
+static void rs300_disarm(struct rs300 *rs300);
+
 static int rs300_set_ctrl(struct v4l2_ctrl *ctrl)
 {
     struct rs300 *rs300 =
         container_of(ctrl->handler, struct rs300, ctrl_handler);
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    int ret = 0;
+    int ret;
+
+    /* Taking on a value the camera already holds */
+    if (rs300->ctrl_reverting)
+        return 0;
 
     /* Add debug info */
-    dev_info(&client->dev, "Setting control ID 0x%x to value %d\n", 
+    dev_info(&client->dev, "Setting control ID 0x%x to value %d\n",
             ctrl->id, ctrl->val);
 
-    switch (ctrl->id) {
-    case V4L2_CID_TEST_PATTERN:
-        ret = rs300_set_test_pattern(rs300, ctrl->val);
-        break;
-    case V4L2_CID_BRIGHTNESS:
-        ret = rs300_brightness_correct(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 1:
-        /* This is our colormap selection control */
-        ret = rs300_set_colormap(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 2:
-        /* This is our FFC (Flat Field Correction) button */
-        dev_info(&client->dev, "FFC trigger received\n");
-        if (ctrl->val == 0) {
-            ret = rs300_shutter_cal(rs300);
-        }
-        break;
-    case V4L2_CID_ZOOM_ABSOLUTE:
-        ret = rs300_set_zoom(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 3:
-        /* This is our scene mode selection control */
-        ret = rs300_set_scene_mode(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CONTRAST:
-        ret = rs300_set_contrast(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 4:  /* DDE */
-        ret = rs300_set_dde(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 5:  /* Spatial NR */
-        ret = rs300_set_spatial_nr(rs300, ctrl->val);
-        break;
-    case V4L2_CID_CUSTOM_BASE + 6:  /* Temporal NR */
-        ret = rs300_set_temporal_nr(rs300, ctrl->val);
-        break;
-    default:
-        dev_err(&client->dev, "Invalid control %d", ctrl->id);
-        ret = -EINVAL;
+    if (ctrl->id == V4L2_CID_RS300_ASYNC_CTRL) {
+        rs300->async_ctrls = ctrl->val;
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_VERIFY) {
+        rs300->verify_policy = ctrl->val;
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_VERIFY_INTERVAL) {
+        rs300->verify_interval = ctrl->val;
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_FFC_INTERVAL) {
+        WRITE_ONCE(rs300->ffc_interval, ctrl->val);
+        rs300_ffc_reschedule(rs300);
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_FFC_DEFER) {
+        WRITE_ONCE(rs300->ffc_defer_until, ctrl->val ?
+                   ktime_add_ms(ktime_get(), ctrl->val) : 0);
+        return 0;
     }
 
+    if (ctrl->id == V4L2_CID_RS300_FFC_ON_STOP) {
+        rs300->ffc_on_stop = ctrl->val;
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_STANDBY) {
+        rs300->standby = ctrl->val;
+        if (rs300->standby == RS300_STANDBY_OFF)
+            rs300_disarm(rs300);
+        else if (rs300->standby == RS300_STANDBY_PREARM &&
+                 completion_done(&rs300->init_done))
+            return rs300_arm(rs300);
+        return 0;
+    }
+
+    if (ctrl->id == V4L2_CID_RS300_PROFILE)
+        return rs300_load_profile(rs300, ctrl->val);
+
+    if (ctrl->id == V4L2_CID_RS300_PROFILE_SAVE) {
+        rs300_save_profile(rs300, ctrl->val);
+        return 0;
+    }
+
+    /* The image parameters arrive as one cluster */
+    if (rs300_ctrl_to_param(ctrl->id))
+        return rs300_set_params(rs300, ctrl);
+
+    /* Commands wait until the deferred part of probe is done */
+    if (!completion_done(&rs300->init_done))
+        return -EBUSY;
+
+    if (ctrl->id == V4L2_CID_RS300_PERSIST)
+        return rs300_persist_params(rs300);
+
+    /* Buttons and the test pattern may need to wake the camera */
+    ret = pm_runtime_resume_and_get(&client->dev);
+    if (ret < 0)
+        return ret;
+
+    if (ctrl->id == V4L2_CID_RS300_REFRESH)
+        ret = rs300_shadow_refresh(rs300);
+    else if (rs300->async_ctrls && rs300_ctrl_is_camera_cmd(ctrl->id))
+        ret = rs300_queue_ctrl(rs300, ctrl);
+    else
+        ret = rs300_apply_ctrl(rs300, ctrl->id, ctrl->val);
+
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
+
     return ret;
 }
 
+/* Value the camera holds, or the one it will get at stream-on */
+static u8 rs300_meta_param(struct rs300 *rs300, enum rs300_param param)
+{
+	s32 value;
+
+	if (!rs300_shadow_load(rs300, param, &value))
+		value = rs300->param_ctrls[param] ?
+			rs300->param_ctrls[param]->cur.val : 0;
+
+	return value;
+}
+
+static void rs300_fill_frame_meta(struct rs300 *rs300,
+				  struct rs300_frame_meta *meta)
+{
+	ktime_t now = ktime_get();
+	u16 flags = 0;
+	u32 ms = 0;
+
+	lockdep_assert_held(&rs300->mutex);
+
+	if (rs300->streaming) {
+		flags |= RS300_META_STREAMING;
+		ms = ktime_ms_delta(now, rs300->stream_start);
+	}
+	if (rs300->armed)
+		flags |= RS300_META_STANDBY;
+	if (ktime_before(now, READ_ONCE(rs300->ffc_until)))
+		flags |= RS300_META_FFC;
+	if (READ_ONCE(rs300->cmd_failed))
+		flags |= RS300_META_CMD_ERROR;
+
+	meta->stream_ms = cpu_to_le32(ms);
+	meta->flags = cpu_to_le16(flags);
+	meta->fps = rs300->fps;
+	meta->colormap = rs300_meta_param(rs300, RS300_PARAM_COLORMAP);
+	meta->scene_mode = rs300_meta_param(rs300, RS300_PARAM_SCENE_MODE);
+	meta->brightness = rs300_meta_param(rs300, RS300_PARAM_BRIGHTNESS);
+	meta->contrast = rs300_meta_param(rs300, RS300_PARAM_CONTRAST);
+	meta->zoom = rs300_meta_param(rs300, RS300_PARAM_ZOOM);
+	meta->ctrl_seq = cpu_to_le32(atomic_read(&rs300->ctrl_seq));
+	meta->ctrl_time_ns = cpu_to_le64(READ_ONCE(rs300->ctrl_time_ns));
+}
+
+/* Readable parameters report what the camera holds, from the shadow cache */
+static int rs300_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct rs300 *rs300 =
+		container_of(ctrl->handler, struct rs300, ctrl_handler);
+	enum rs300_param param;
+	unsigned int i;
+	s32 value;
+
+	if (ctrl->id == V4L2_CID_RS300_FRAME_META) {
+		rs300_fill_frame_meta(rs300, (struct rs300_frame_meta *)ctrl->p_new.p_u8);
+		return 0;
+	}
+
+	/* Called for the cluster master, fill in the whole cluster */
+	for (i = 0; i < ctrl->ncontrols; i++) {
+		if (!ctrl->cluster[i])
+			continue;
+
+		/* Not known yet or not sent yet, report the last value set */
+		param = rs300_ctrl_to_param(ctrl->cluster[i]->id);
+		if (param && !test_bit(param, &rs300->desired_dirty) &&
+		    rs300_shadow_load(rs300, param, &value))
+			ctrl->cluster[i]->val = value;
+	}
+
+	return 0;
+}
+
 static const struct v4l2_ctrl_ops rs300_ctrl_ops = {
+	.g_volatile_ctrl = rs300_g_volatile_ctrl,
 	.s_ctrl = rs300_set_ctrl,
 };
 
@@ -1615,19 +2210,25 @@ static int rs300_enum_mbus_code(struct v4l2_subdev *sd,
 				 struct v4l2_subdev_state *sd_state,
 				 struct v4l2_subdev_mbus_code_enum *code)
 {
-	struct rs300 *rs300 = to_rs300(sd);
 	//struct i2c_client *client = v4l2_get_subdevdata(sd);
 	
 	if (code->pad >= NUM_PADS)
 		return -EINVAL;
 
 	if (code->pad == IMAGE_PAD) {
-		if (code->index >= ARRAY_SIZE(supported_modes))
-			return -EINVAL;
+		struct rs300 *rs300 = to_rs300(sd);
+		unsigned int i, n = 0;
+
+		for (i = 0; i < ARRAY_SIZE(rs300_formats); i++) {
+			if (!rs300_format_usable(rs300, &rs300_formats[i]))
+				continue;
+			if (n++ == code->index) {
+				code->code = rs300_formats[i].code;
+				return 0;
+			}
+		}
 
-		mutex_lock(&rs300->mutex);
-		code->code = supported_modes[code->index].code;
-		mutex_unlock(&rs300->mutex);
+		return -EINVAL;
 	} else {
 		if (code->index > 0)
 			return -EINVAL;
@@ -1644,22 +2245,32 @@ static int rs300_enum_frame_sizes(struct v4l2_subdev *sd,
 {
 	//struct i2c_client *client = v4l2_get_subdevdata(sd);
 	struct rs300 *rs300 = to_rs300(sd);
-	u32 code;
 
 	if (fse->pad >= NUM_PADS)
 		return -EINVAL;
 
 	if (fse->pad == IMAGE_PAD) {
-		if (fse->index >= ARRAY_SIZE(supported_modes))
+		const struct rs300_format *format = rs300_find_format(fse->code);
+		const struct rs300_mode *mode;
+		int ret;
+
+		if (!format || !rs300_format_usable(rs300, format))
 			return -EINVAL;
 
+		ret = rs300_wait_init(rs300);
+		if (ret)
+			return ret;
+
 		mutex_lock(&rs300->mutex);
-		code = rs300_get_format_code(rs300, fse->code);
+		mode = rs300_enum_mode(rs300, fse->index);
 		mutex_unlock(&rs300->mutex);
-	
-	fse->min_width  = supported_modes[fse->index].width;
+
+		if (!mode)
+			return -EINVAL;
+
+	fse->min_width  = mode->width;
 	fse->max_width  = fse->min_width;
-	fse->min_height = supported_modes[fse->index].height;
+	fse->min_height = mode->height;
 	fse->max_height = fse->min_height;
 	} else {
 		if (fse->code != MEDIA_BUS_FMT_SENSOR_DATA || fse->index > 0)
@@ -1756,41 +2367,31 @@ static int rs300_set_pad_fmt(struct v4l2_subdev *sd,
 	const struct rs300_mode *mode;
 	struct v4l2_mbus_framefmt *framefmt;
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	unsigned int i;
+	int ret;
 
 	if (fmt->pad >= NUM_PADS)
 		return -EINVAL;
 
+	/* The supported modes are known once the module is identified */
+	ret = rs300_wait_init(rs300);
+	if (ret)
+		return ret;
+
 	mutex_lock(&rs300->mutex);
 
 	dev_info(&client->dev, "rs300_set_pad_fmt input: pad=%d, which=%d, code=0x%x, width=%d, height=%d",
 		fmt->pad, fmt->which, fmt->format.code, fmt->format.width, fmt->format.height);
 
 	if (fmt->pad == IMAGE_PAD) {
-		/* Find the closest supported format code */
-		for (i = 0; i < ARRAY_SIZE(codes); i++)
-			if (codes[i] == fmt->format.code)
-				break;
-		if (i >= ARRAY_SIZE(codes))
-			i = 0; /* Default to first supported code if not found */
-
-		fmt->format.code = rs300_get_format_code(rs300, codes[i]);
+		/* Only codes the camera can send */
+		fmt->format.code = rs300_get_format_code(rs300, fmt->format.code);
 
 		/* Find the closest supported resolution */
 		dev_info(&client->dev, "rs300_set_pad_fmt searching for nearest mode to %dx%d", 
 			fmt->format.width, fmt->format.height);
 
-		/* Print all supported modes for debugging */
-		for (i = 0; i < ARRAY_SIZE(supported_modes); i++) {
-			dev_info(&client->dev, "Supported mode[%d]: %dx%d", 
-				i, supported_modes[i].width, supported_modes[i].height);
-		}
-
-		/* Use v4l2_find_nearest_size correctly */
-		mode = v4l2_find_nearest_size(supported_modes,
-					      ARRAY_SIZE(supported_modes),
-					      width, height,
-					      fmt->format.width, fmt->format.height);
+		/* Only modes the attached module supports */
+		mode = rs300_find_mode(rs300, fmt->format.width, fmt->format.height);
 
 		/* Update the format with the selected mode */
 		dev_info(&client->dev, "rs300_set_pad_fmt selected mode: width=%d, height=%d", 
@@ -1805,17 +2406,19 @@ static int rs300_set_pad_fmt(struct v4l2_subdev *sd,
 			dev_info(&client->dev, "Set TRY format: code=0x%x, %dx%d",
 				framefmt->code, framefmt->width, framefmt->height);
 		} else {
+			/* The camera takes a new size or output at the next stream start */
+			if (rs300->streaming && (mode != rs300->mode ||
+			    fmt->format.code != rs300->fmt.code)) {
+				mutex_unlock(&rs300->mutex);
+				return -EBUSY;
+			}
+
 			/* Update the active format and mode */
 			rs300->fmt = fmt->format;
 			rs300->mode = mode;
+			rs300->fps = rs300_mode_nearest_fps(mode, rs300->fps);
 			
-			// Set link frequency based on the selected mode
-			if (rs300->link_frequency) {
-				int idx = (mode->width == 256 && mode->height == 192) ? 1 : 0;
-				__v4l2_ctrl_s_ctrl(rs300->link_frequency, idx);
-				dev_info(&client->dev, "Updated link frequency index to %d for %dx%d",
-						 idx, mode->width, mode->height);
-			}
+			rs300_update_link_freq(rs300);
 			
 			dev_info(&client->dev, "Set ACTIVE format: code=0x%x, %dx%d",
 				rs300->fmt.code, rs300->fmt.width, rs300->fmt.height);
@@ -1836,131 +2439,289 @@ static int rs300_set_pad_fmt(struct v4l2_subdev *sd,
 static int rs300_set_framefmt(struct rs300 *rs300)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    
+
     dev_info(&client->dev, "Setting frame format: code=0x%x", rs300->fmt.code);
-    
-    switch (rs300->fmt.code) {
-    case MEDIA_BUS_FMT_YUYV8_1X16:
-        dev_info(&client->dev, "Using YUYV8_1X16 format");
-        // Add format-specific setup here if needed
-        return 0;
-    case MEDIA_BUS_FMT_YUYV8_2X8:
-        dev_info(&client->dev, "Using YUYV8_2X8 format");
-        return 0;
-    case MEDIA_BUS_FMT_UYVY8_2X8:
-        dev_info(&client->dev, "Using UYVY8_2X8 format");
+
+    /* The output is selected by the start command built from the format */
+    if (!rs300_find_format(rs300->fmt.code)) {
+        dev_err(&client->dev, "Unsupported format code: 0x%x", rs300->fmt.code);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Payload CRC in the reserved bytes, then the header CRC */
+static void rs300_stream_cmd_crc(u8 *cmd)
+{
+    unsigned short crcdata;
+
+    crcdata = do_crc(cmd + RS300_VCMD_LEN, RS300_STREAM_CFG_LEN);
+    cmd[14] = crcdata & 0xff;
+    cmd[15] = crcdata >> 8;
+
+    crcdata = do_crc(cmd, 16);
+    cmd[16] = crcdata & 0xff;
+    cmd[17] = crcdata >> 8;
+}
+
+/* Stop command for the running size and frame rate */
+static void rs300_build_stop_cmd(struct rs300 *rs300, u8 *cmd)
+{
+    u8 *cfg = cmd + RS300_VCMD_LEN;
+
+    memcpy(cmd, stop_regs, RS300_VCMD_LEN + RS300_STREAM_CFG_LEN);
+    cfg[3] = rs300->fps;
+    cfg[4] = rs300->mode->width & 0xff;
+    cfg[5] = rs300->mode->width >> 8;
+    cfg[6] = rs300->mode->height & 0xff;
+    cfg[7] = rs300->mode->height >> 8;
+
+    rs300_stream_cmd_crc(cmd);
+}
+
+static void rs300_stop_streaming(struct rs300 *rs300)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    u8 cmd[RS300_VCMD_LEN + RS300_STREAM_CFG_LEN];
+
+    dev_info(&client->dev, "Stopping streaming");
+
+    rs300_build_stop_cmd(rs300, cmd);
+    if (rs300_vcmd_exec(rs300, RS300_VCMD_VIDEO, cmd, sizeof(cmd), NULL, 0) < 0) {
+        dev_err(&client->dev, "Error writing stop registers");
+    }
+    rs300->video_running = false;
+
+    dev_info(&client->dev, "Streaming stopped");
+}
+
+static int rs300_set_fps(struct rs300 *rs300, int fps)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    int ret;
+
+    if (!rs300_mode_has_fps(rs300->mode, fps)) {
+        dev_err(&client->dev, "%d fps not supported at %ux%u", fps,
+                rs300->mode->width, rs300->mode->height);
+        return -EINVAL;
+    }
+
+    /* The camera keeps the MIPI setup while powered */
+    if (rs300->mipi_fps == fps)
         return 0;
-    }        
 
-    dev_err(&client->dev, "Unsupported format code: 0x%x", rs300->fmt.code);
-    return -EINVAL;
+    dev_info(&client->dev, "Setting camera to %d fps", fps);
+
+    ret = rs300_vcmd_run(rs300, RS300_CMD_SET_MIPI, fps, NULL);
+    if (ret) {
+        dev_warn(&client->dev, "FPS command failed: %d", ret);
+        return ret;
+    }
+
+    rs300->mipi_fps = fps;
+    dev_info(&client->dev, "FPS set to %d successfully", fps);
+    return 0;
 }
 
-static void rs300_stop_streaming(struct rs300 *rs300)
+/*
+ * Send the parameters set while not streaming, skipping any the camera
+ * already holds. Called with rs300->mutex held. A parameter that fails
+ * stays pending for the next stream-on.
+ */
+static void rs300_sync_params(struct rs300 *rs300)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    struct v4l2_ctrl *ctrl;
+    unsigned int i;
+    s32 applied;
+    int ret;
 
-    dev_info(&client->dev, "Stopping streaming");
+    for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++) {
+        ctrl = rs300->param_ctrls[i];
+        if (!ctrl || !test_and_clear_bit(i, &rs300->desired_dirty))
+            continue;
 
-    /* Write stop registers */
-    if (write_regs(client, I2C_VD_BUFFER_RW, stop_regs, sizeof(stop_regs)) < 0) {
-        dev_err(&client->dev, "Error writing stop registers");
+        if (rs300_shadow_load(rs300, i, &applied) && applied == ctrl->cur.val)
+            continue;
+
+        ret = rs300_apply_ctrl(rs300, ctrl->id, ctrl->cur.val);
+        if (ret) {
+            dev_warn(&client->dev, "Failed to apply %s: %d",
+                     rs300_params[i].name, ret);
+            set_bit(i, &rs300->desired_dirty);
+        }
     }
+}
 
-    dev_info(&client->dev, "Streaming stopped");
+/* Rebuild the start command only when its payload changes; true if it did */
+static bool rs300_update_start_cmd(struct rs300 *rs300)
+{
+    const struct rs300_format *format = rs300_find_format(rs300->fmt.code);
+    u8 *cmd = rs300->start_cmd;
+    u8 cfg[RS300_STREAM_CFG_LEN];
+
+    memcpy(cfg, start_regs + RS300_VCMD_LEN, sizeof(cfg));
+    cfg[1] = format && format->raw ? rs300->raw_type : rs300->type;
+    cfg[3] = rs300->fps;
+    cfg[4] = rs300->mode->width & 0xff;
+    cfg[5] = rs300->mode->width >> 8;
+    cfg[6] = rs300->mode->height & 0xff;
+    cfg[7] = rs300->mode->height >> 8;
+
+    if (rs300->start_cmd_valid &&
+        !memcmp(cmd + RS300_VCMD_LEN, cfg, sizeof(cfg)))
+        return false;
+
+    memcpy(cmd, start_regs, RS300_VCMD_LEN);
+    memcpy(cmd + RS300_VCMD_LEN, cfg, sizeof(cfg));
+    rs300_stream_cmd_crc(cmd);
+
+    rs300->start_cmd_valid = true;
+    return true;
 }
 
-static int rs300_set_fps(struct rs300 *rs300, int fps)
+/*
+ * Program the camera and start the video path. Called with the mutex held
+ * and the camera powered, from stream-on and from system resume.
+ */
+static int rs300_start_streaming(struct rs300 *rs300)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
     u8 status_buffer[1];
+    ktime_t t0, t1;
     int ret;
-    int retry_count = 0;
-    const int max_retries = 15;
-    unsigned short crc;
-    
-    //check if fps is 25, 30, 50, or 60
-    //if not exit function but don't end program
-    if (fps != 25 && fps != 30 && fps != 50 && fps != 60) {
-        dev_warn(&client->dev, "Invalid FPS value: %d", fps);
+
+    ret = rs300_set_framefmt(rs300);
+    if (ret) {
+        dev_err(&client->dev, "error set framefmt\n");
+        return ret;
+    }
+
+    /* Still running from warm standby with the same configuration */
+    if (!rs300_update_start_cmd(rs300) && rs300->video_running &&
+        rs300->mipi_fps == rs300->fps) {
+        t0 = ktime_get();
+        rs300->stream_on_us[RS300_STREAM_FPS] = 0;
+        rs300->stream_on_us[RS300_STREAM_START] = 0;
+        rs300->stream_on_us[RS300_STREAM_SETTLE] = 0;
+        rs300_sync_params(rs300);
+        rs300->stream_start = ktime_get();
+        rs300->stream_on_us[RS300_STREAM_PARAMS] = ktime_us_delta(rs300->stream_start, t0);
+        dev_info(&client->dev, "Stream resumed from standby in %u us",
+                 rs300->stream_on_us[RS300_STREAM_PARAMS]);
         return 0;
     }
-    
-    dev_info(&client->dev, "Setting camera to %d fps", fps);
-    
-    /* Construct the command buffer for setting FPS */
-    cmd_buffer[0] = 0x10;  /* Command Class */
-    cmd_buffer[1] = 0x10;  /* Module Command Index */
-    cmd_buffer[2] = 0x46;  /* SubCmd -  MIPI */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = 0x01;  /* Parameter 1 - Enable*/
-    cmd_buffer[5] = 0x03;  /* Parameter 2 - MIPI Progressive*/
-    cmd_buffer[6] = fps;   /* Parameter 3 - FPS */
-    cmd_buffer[9] = 0x00; 
-    cmd_buffer[7] = 0x00; 
-    cmd_buffer[8] = 0x00; 
-    cmd_buffer[10] = 0x00;
-    cmd_buffer[11] = 0x00;
-    cmd_buffer[12] = 0x00;  
-    cmd_buffer[13] = 0x00;
-    cmd_buffer[14] = 0x00;
-    cmd_buffer[15] = 0x00;
-    
-    /* Calculate CRC/checksum for the command */
-    crc = do_crc(cmd_buffer, 16);
-    /* Swap byte order to match the expected format */
-    cmd_buffer[16] = crc & 0xFF;         /* Low byte of CRC first */
-    cmd_buffer[17] = (crc >> 8) & 0xFF;  /* High byte of CRC second */
-    
-    dev_info(&client->dev, "FPS command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command to command buffer register (0x1d00) */
-    ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
+
+    /* Armed with a different mode or rate, start over */
+    if (rs300->video_running)
+        rs300_stop_streaming(rs300);
+
+    t0 = ktime_get();
+
+    // Set FPS first
+    /*
+     * Some modules reject the MIPI frame rate command but stream at
+     * the rate carried by the start command, so carry on regardless.
+     */
+    ret = rs300_set_fps(rs300, rs300->fps);
+    if (ret)
+        dev_warn(&client->dev, "Failed to set camera to %d fps: %d", rs300->fps, ret);
+    t1 = ktime_get();
+    rs300->stream_on_us[RS300_STREAM_FPS] = ktime_us_delta(t1, t0);
+
+    dev_dbg(&client->dev, "Start registers: %*ph",
+            (int)sizeof(rs300->start_cmd), rs300->start_cmd);
+
+    /* The mailbox engine waits for the camera to leave the busy state */
+    ret = rs300_vcmd_exec(rs300, RS300_VCMD_VIDEO, rs300->start_cmd,
+                          sizeof(rs300->start_cmd), NULL, 0);
     if (ret) {
-        dev_warn(&client->dev, "Failed to write FPS command: %d", ret);
-        return 0;  // Changed from return ret
+        dev_err(&client->dev, "error start rs300: %d\n", ret);
+        return ret;
     }
-    
-    /* Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        msleep(300);
-        
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_warn(&client->dev, "Failed to read command status: %d", ret);
-            return 0;  // Changed from return ret
-        }
-        
-        dev_info(&client->dev, "FPS command status: 0x%02X", status_buffer[0]);
-        
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  /* Bits 2-7 */
-        
-        if (!is_busy) {
-            if (has_failed) {
-                dev_warn(&client->dev, "FPS command execution failed with error code: 0x%02X", error_code);
-                return 0;  // Changed from return -EIO
-            }
-            dev_info(&client->dev, "FPS set to %d successfully", fps);
-            return 0;
+    rs300->video_running = true;
+    t0 = ktime_get();
+    rs300->stream_on_us[RS300_STREAM_START] = ktime_us_delta(t0, t1);
+
+    /*
+     * The video path is running once the start command completes; the
+     * first full frame follows within one frame period. Check the
+     * camera has not flagged an error by then.
+     */
+    fsleep(USEC_PER_SEC / clamp(rs300->fps, 25, 60));
+    mutex_lock(&rs300->cmd_lock);
+    ret = read_regs(rs300, I2C_VD_BUFFER_STATUS, status_buffer, 1);
+    mutex_unlock(&rs300->cmd_lock);
+    if (ret == 0) {
+        dev_dbg(&client->dev, "Final stream status: 0x%02x", status_buffer[0]);
+        if (status_buffer[0] & VCMD_ERR_STS_BIT) {
+            dev_err(&client->dev, "Camera reported error after stream start");
+            return -EIO;
         }
-        
-        dev_info(&client->dev, "FPS command is busy, retrying...");
-        retry_count++;
     }
-    
-    dev_warn(&client->dev, "FPS command timed out after %d retries", max_retries);
-    return 0;  // Changed from return -ETIMEDOUT
+    t1 = ktime_get();
+    rs300->stream_on_us[RS300_STREAM_SETTLE] = ktime_us_delta(t1, t0);
+
+    rs300_sync_params(rs300);
+    rs300->stream_start = ktime_get();
+    rs300->stream_on_us[RS300_STREAM_PARAMS] = ktime_us_delta(rs300->stream_start, t1);
+
+    dev_info(&client->dev, "Stream started in %u us (fps %u, start %u, settle %u, params %u)",
+             rs300->stream_on_us[RS300_STREAM_FPS] +
+             rs300->stream_on_us[RS300_STREAM_START] +
+             rs300->stream_on_us[RS300_STREAM_SETTLE] +
+             rs300->stream_on_us[RS300_STREAM_PARAMS],
+             rs300->stream_on_us[RS300_STREAM_FPS],
+             rs300->stream_on_us[RS300_STREAM_START],
+             rs300->stream_on_us[RS300_STREAM_SETTLE],
+             rs300->stream_on_us[RS300_STREAM_PARAMS]);
+
+    return 0;
+}
+
+/* Start the camera ahead of STREAMON. Called with the mutex held. */
+static int rs300_arm(struct rs300 *rs300)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    int ret;
+
+    if (rs300->streaming || rs300->armed)
+        return 0;
+
+    ret = pm_runtime_resume_and_get(&client->dev);
+    if (ret < 0)
+        return ret;
+
+    ret = rs300_start_streaming(rs300);
+    if (ret) {
+        pm_runtime_put(&client->dev);
+        return ret;
+    }
+
+    rs300->armed = true;
+    dev_info(&client->dev, "Camera armed in standby");
+    return 0;
+}
+
+/* Stop a camera left running by warm standby. Called with the mutex held. */
+static void rs300_disarm(struct rs300 *rs300)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+
+    if (!rs300->armed)
+        return;
+
+    rs300_stop_streaming(rs300);
+    rs300->armed = false;
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
 }
 
 static int rs300_set_stream(struct v4l2_subdev *sd, int enable)
 {
     struct i2c_client *client = v4l2_get_subdevdata(sd);
     struct rs300 *rs300 = to_rs300(sd);
-    unsigned short crcdata;
-    u8 status_buffer[1];
     int ret = 0;
 
     dev_info(&client->dev, "Setting stream to %d", enable);
@@ -1985,6 +2746,12 @@ static int rs300_set_stream(struct v4l2_subdev *sd, int enable)
         }
     }
 
+    if (enable) {
+        ret = rs300_wait_init(rs300);
+        if (ret)
+            return ret;
+    }
+
     mutex_lock(&rs300->mutex);
     if (rs300->streaming == enable) {
         dev_info(&client->dev, "Stream already in desired state");
@@ -1993,128 +2760,120 @@ static int rs300_set_stream(struct v4l2_subdev *sd, int enable)
     }
 
     if (enable) {
-
-        // Set FPS first
-        ret = rs300_set_fps(rs300, fps);
-        if (ret) {
-            dev_err(&client->dev, "Failed to set camera to %d fps: %d", fps, ret);
-            goto error_unlock;
-        }
-        dev_info(&client->dev, "FPS is set to %d", fps);
-
-        rs300->streaming = enable;
-        start_regs[19] = type;
-        start_regs[21] = fps;  // Add this line to set the FPS from the module parameter
-        start_regs[22] = rs300->mode->width & 0xff;
-        start_regs[23] = rs300->mode->width >> 8;
-        start_regs[24] = rs300->mode->height & 0xff;
-        start_regs[25] = rs300->mode->height >> 8;
-
-        dev_info(&client->dev, "Start registers before CRC: %*ph", (int)sizeof(start_regs), start_regs);
-
-        //update crc
-        crcdata = do_crc((uint8_t*)(start_regs+18), 10);
-        start_regs[14] = crcdata & 0xff;
-        start_regs[15] = crcdata >> 8;
-        
-        crcdata = do_crc((uint8_t*)(start_regs), 16);
-        start_regs[16] = crcdata & 0xff;
-        start_regs[17] = crcdata >> 8;
-        
-        dev_info(&client->dev, "Start registers after CRC: %*ph", (int)sizeof(start_regs), start_regs);
-        dev_info(&client->dev, "Writing start registers to device");
-        
-        if (write_regs(client, I2C_VD_BUFFER_RW, start_regs, sizeof(start_regs)) < 0) {
-            dev_err(&client->dev, "error start rs300\n");
-            goto error_unlock;
-        }
-
-        // Read back the registers to verify they were written correctly
-        u8 verify_regs[sizeof(start_regs)];
-        if (read_regs(client, I2C_VD_BUFFER_RW, verify_regs, sizeof(verify_regs)) == 0) {
-            dev_info(&client->dev, "Read back registers: %*ph", (int)sizeof(verify_regs), verify_regs);
-            if (memcmp(start_regs, verify_regs, sizeof(start_regs)) != 0) {
-                dev_err(&client->dev, "Register verification failed!");
-            }
-        }
-
-        //check if device is ready
- 
-
-        ret = rs300_set_framefmt(rs300);
-        if (ret) {
-            dev_err(&client->dev, "error set framefmt\n");
-            goto error_unlock;
-        }
-        
-        dev_info(&client->dev, "Stream started successfully");
-
-        // Add retry loop for busy status
-        int retry = 0;
-        const int max_retries = 10;  // Adjust as needed
-        while (retry < max_retries) {
-            ret = read_regs(client, I2C_VD_BUFFER_STATUS, status_buffer, 1);
-            if (ret == 0) {
-                dev_info(&client->dev, "Stream status check %d: 0x%02x", retry, status_buffer[0]);
-                
-                if (!(status_buffer[0] & VCMD_BUSY_STS_BIT)) {
-                    dev_info(&client->dev, "Camera is ready");
-                    break;
-                }
-                
-                if (status_buffer[0] & VCMD_RST_STS_BIT) {
-                    dev_err(&client->dev, "Camera reset failed");
-                    ret = -EIO;
-                    goto error_unlock;
-                }
-                
-                if (status_buffer[0] & VCMD_ERR_STS_BIT) {
-                    dev_err(&client->dev, "Camera error: 0x%02x", status_buffer[0] & VCMD_ERR_STS_BIT);
-                    ret = -EIO;
-                    goto error_unlock;
-                }
-            }
-            
-            msleep(100);  // Wait 100ms between checks
-            retry++;
-        }
-
-        if (retry >= max_retries) {
-            dev_err(&client->dev, "Camera remained busy after %d retries", max_retries);
-            ret = -ETIMEDOUT;
-            goto error_unlock;
-        }
-
-        // Verify streaming status
-        msleep(2000);  // Wait a bit after busy clear
-        ret = read_regs(client, I2C_VD_BUFFER_STATUS, status_buffer, 1);
-        if (ret == 0) {
-            dev_info(&client->dev, "Final stream status: 0x%02x", status_buffer[0]);
-            if (status_buffer[0] & VCMD_ERR_STS_BIT) {
-                dev_err(&client->dev, "Camera reported error after stream start");
-                ret = -EIO;
+        /* Warm standby hands its power reference over to the stream */
+        if (rs300->armed) {
+            rs300->armed = false;
+        } else {
+            ret = pm_runtime_resume_and_get(&client->dev);
+            if (ret < 0)
                 goto error_unlock;
-            }
         }
+
+        ret = rs300_start_streaming(rs300);
+        if (ret)
+            goto error_put;
+    } else if (rs300->standby != RS300_STANDBY_OFF) {
+        /* Leave the camera running and keep the power reference */
+        dev_info(&client->dev, "Stream stopped, camera left in standby");
+        rs300->armed = true;
     } else {
         dev_info(&client->dev, "Stopping stream");
         rs300_stop_streaming(rs300);
         dev_info(&client->dev, "Stream stopped");
+        pm_runtime_mark_last_busy(&client->dev);
+        pm_runtime_put_autosuspend(&client->dev);
     }
 
+    /* Calibrate while nobody is looking, before the camera powers down */
+    if (!enable && rs300->ffc_on_stop)
+        rs300_ffc_queue(rs300, &rs300->ffc_work, 0);
+
     rs300->streaming = enable;
     mutex_unlock(&rs300->mutex);
 
     return ret;
 
+error_put:
+    pm_runtime_put(&client->dev);
 error_unlock:
     mutex_unlock(&rs300->mutex);
     return ret;
 }
 
-static const s64 link_freq_menu_items[] = {
-	RS300_LINK_RATE,//80m
-};
+static int rs300_enum_frame_interval(struct v4l2_subdev *sd,
+				     struct v4l2_subdev_state *sd_state,
+				     struct v4l2_subdev_frame_interval_enum *fie)
+{
+	struct rs300 *rs300 = to_rs300(sd);
+	const struct rs300_mode *mode;
+	int ret = -EINVAL;
+
+	if (fie->pad != IMAGE_PAD || fie->index >= RS300_MAX_MODE_FPS)
+		return -EINVAL;
+
+	mutex_lock(&rs300->mutex);
+	mode = rs300_find_mode(rs300, fie->width, fie->height);
+	if (mode->width == fie->width && mode->height == fie->height &&
+	    mode->fps[fie->index]) {
+		fie->interval.numerator = 1;
+		fie->interval.denominator = mode->fps[fie->index];
+		ret = 0;
+	}
+	mutex_unlock(&rs300->mutex);
+
+	return ret;
+}
+
+static int rs300_g_frame_interval(struct v4l2_subdev *sd,
+				  struct v4l2_subdev_frame_interval *fi)
+{
+	struct rs300 *rs300 = to_rs300(sd);
+
+	mutex_lock(&rs300->mutex);
+	fi->interval.numerator = 1;
+	fi->interval.denominator = rs300->fps;
+	mutex_unlock(&rs300->mutex);
+
+	return 0;
+}
+
+/*
+ * Pick the mode's frame rate nearest to the requested interval. While
+ * streaming the camera is reprogrammed straight away.
+ */
+static int rs300_s_frame_interval(struct v4l2_subdev *sd,
+				  struct v4l2_subdev_frame_interval *fi)
+{
+	struct rs300 *rs300 = to_rs300(sd);
+	int fps;
+	int ret = 0;
+
+	if (fi->pad != IMAGE_PAD)
+		return -EINVAL;
+
+	mutex_lock(&rs300->mutex);
+
+	if (fi->interval.numerator && fi->interval.denominator)
+		fps = DIV_ROUND_CLOSEST(fi->interval.denominator,
+					fi->interval.numerator);
+	else
+		fps = rs300->fps;
+	fps = rs300_mode_nearest_fps(rs300->mode, fps);
+
+	if (rs300->streaming)
+		ret = rs300_set_fps(rs300, fps);
+	if (!ret) {
+		rs300->fps = fps;
+		rs300_update_link_freq(rs300);
+	}
+
+	fi->interval.numerator = 1;
+	fi->interval.denominator = rs300->fps;
+
+	mutex_unlock(&rs300->mutex);
+	return ret;
+}
+
 /* -----------------------------------------------------------------------------
  * V4L2 subdev internal operations
  */
@@ -2132,15 +2891,16 @@ static int rs300_init_cfg(struct v4l2_subdev *sd,
 			   struct v4l2_subdev_state *state)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct rs300 *rs300 = to_rs300(sd);
 	struct v4l2_mbus_framefmt *format;
 
 	dev_info(&client->dev, "rs300_init_cfg");
 
 	/* Initialize the format for the image pad */
 	format = v4l2_subdev_get_fmt(sd, state, IMAGE_PAD);
-	format->code = supported_modes[mode].code;
-	format->width = supported_modes[mode].width;
-	format->height = supported_modes[mode].height;
+	format->code = rs300->mode->code;
+	format->width = rs300->mode->width;
+	format->height = rs300->mode->height;
 	format->field = V4L2_FIELD_NONE;
 	rs300_reset_colorspace(format);
 
@@ -2162,7 +2922,19 @@ static int rs300_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	struct rs300 *rs300 = to_rs300(sd);
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
     
+    int ret;
+
     dev_info(&client->dev, "rs300_open");
+
+	ret = rs300_wait_init(rs300);
+	if (ret)
+		return ret;
+
+	/* Keep the camera, and what has been set on it, powered while open */
+	ret = pm_runtime_resume_and_get(&client->dev);
+	if (ret < 0)
+		return ret;
+
 	mutex_lock(&rs300->mutex);
 	
 	/* Initialize the format configuration */
@@ -2172,6 +2944,16 @@ static int rs300_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	return 0;
 }
 
+static int rs300_close(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_put_autosuspend(&client->dev);
+
+	return 0;
+}
+
 
 static int rs300_power_on(struct device *dev)
 {
@@ -2195,44 +2977,267 @@ static int rs300_power_on(struct device *dev)
 */
     dev_info(dev, "Power on complete");
 
-    return 0;
-}
+    return 0;
+}
+
+static int rs300_power_off(struct device *dev)
+{
+	struct v4l2_subdev *sd = dev_get_drvdata(dev);
+	struct rs300 *rs300 = to_rs300(sd);
+	unsigned int i;
+
+	gpiod_set_value_cansleep(rs300->reset_gpio, 1); //logic high -> device tree defines reset: logic high = 0V (active low)
+    dev_info(dev, "Resetting rs300");
+	regulator_bulk_disable(rs300_NUM_SUPPLIES, rs300->supplies);
+    dev_info(dev, "Regulators disabled");
+	rs300->mipi_fps = 0;
+	rs300->video_running = false;
+
+	/* The camera is back at its defaults; resend what was set at stream-on */
+	for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++) {
+		if (test_and_clear_bit(i, &rs300->params_written)) {
+			clear_bit(i, &rs300->shadow_valid);
+			set_bit(i, &rs300->desired_dirty);
+		}
+	}
+
+	return 0;
+}
+
+/* Wait for the camera to answer on the mailbox after power-up */
+static int rs300_wait_ready(struct rs300 *rs300)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(RS300_BOOT_TIMEOUT_MS);
+	u8 status;
+	int ret;
+
+	for (;;) {
+		mutex_lock(&rs300->cmd_lock);
+		ret = read_regs(rs300, I2C_VD_BUFFER_STATUS, &status, 1);
+		mutex_unlock(&rs300->cmd_lock);
+		if (!ret && !(status & VCMD_BUSY_STS_BIT))
+			return 0;
+
+		if (time_after(jiffies, timeout))
+			return ret ? ret : -ETIMEDOUT;
+
+		msleep(RS300_BOOT_POLL_MS);
+	}
+}
+
+static int __maybe_unused rs300_runtime_suspend(struct device *dev)
+{
+	return rs300_power_off(dev);
+}
+
+static int __maybe_unused rs300_runtime_resume(struct device *dev)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+	ktime_t start = ktime_get();
+	u32 us;
+	int ret;
+
+	ret = rs300_power_on(dev);
+	if (ret)
+		return ret;
+
+	ret = rs300_wait_ready(rs300);
+	if (ret) {
+		dev_err(dev, "Camera not ready after power on: %d\n", ret);
+		rs300_power_off(dev);
+		return ret;
+	}
+
+	us = ktime_us_delta(ktime_get(), start);
+	WRITE_ONCE(rs300->resume_last_us, us);
+	if (us > rs300->resume_max_us)
+		WRITE_ONCE(rs300->resume_max_us, us);
+	WRITE_ONCE(rs300->resume_count, rs300->resume_count + 1);
+
+	return 0;
+}
+
+/*
+ * System sleep: stop the video path cleanly and power down. Controls set
+ * since power-up are marked dirty by power-off, so a stream that was
+ * running is restarted on resume with all of them replayed in one pass.
+ */
+static int __maybe_unused rs300_suspend(struct device *dev)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+
+	rs300_ffc_stop(rs300, true);
+
+	/* Let queued control writes reach the camera first */
+	flush_workqueue(rs300->ctrl_wq);
+	cancel_delayed_work_sync(&rs300->ffc_work);
+	cancel_delayed_work_sync(&rs300->ffc_end_work);
+
+	mutex_lock(&rs300->mutex);
+	if (rs300->streaming || rs300->armed)
+		rs300_stop_streaming(rs300);
+	mutex_unlock(&rs300->mutex);
+
+	return pm_runtime_force_suspend(dev);
+}
+
+static int __maybe_unused rs300_resume(struct device *dev)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&rs300->mutex);
+	if (rs300->streaming || rs300->armed) {
+		ret = rs300_start_streaming(rs300);
+		if (ret) {
+			dev_err(dev, "Failed to restart streaming: %d\n", ret);
+			rs300->streaming = false;
+			rs300->armed = false;
+			pm_runtime_put(dev);
+		}
+	}
+
+	mutex_unlock(&rs300->mutex);
+
+	rs300_ffc_stop(rs300, false);
+	rs300_ffc_reschedule(rs300);
+
+	return ret;
+}
+
+static const struct dev_pm_ops rs300_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(rs300_suspend, rs300_resume)
+	SET_RUNTIME_PM_OPS(rs300_runtime_suspend, rs300_runtime_resume, NULL)
+};
+
+static int rs300_get_regulators(struct rs300 *rs300)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+	unsigned int i;
+
+	for (i = 0; i < rs300_NUM_SUPPLIES; i++)
+		rs300->supplies[i].supply = rs300_supply_names[i];
+
+	return devm_regulator_bulk_get(&client->dev, 
+						rs300_NUM_SUPPLIES,
+				       rs300->supplies);
+}
+
+static int rs300_log_status(struct v4l2_subdev *sd)
+{
+	struct rs300 *rs300 = to_rs300(sd);
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct rs300_vcmd_stats *stats;
+	unsigned int i;
+	s32 value;
+
+	v4l2_ctrl_subdev_log_status(sd);
+
+	mutex_lock(&rs300->mutex);
+	dev_info(&client->dev, "camera: %s, mode %ux%u at %d fps",
+		 rs300->device_name[0] ? rs300->device_name : "unidentified",
+		 rs300->mode->width, rs300->mode->height, rs300->fps);
+	mutex_unlock(&rs300->mutex);
+
+	for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++) {
+		if (test_bit(i, &rs300->desired_dirty))
+			dev_info(&client->dev, "camera %s: pending stream-on",
+				 rs300_params[i].name);
+		else if (rs300_shadow_load(rs300, i, &value))
+			dev_info(&client->dev, "camera %s: %d",
+				 rs300_params[i].name, value);
+		else
+			dev_info(&client->dev, "camera %s: unknown",
+				 rs300_params[i].name);
+	}
+
+	mutex_lock(&rs300->cmd_lock);
+	for (i = 0; i < RS300_VCMD_NUM_CLASSES; i++) {
+		stats = &rs300->vcmd_stats[i];
+		dev_info(&client->dev,
+			 "%s commands: %u ok, %u failed (%u timeouts, %u CRC), last %u us, avg %u us, max %u us",
+			 rs300_vcmd_profiles[i].name, stats->count, stats->errors,
+			 stats->timeouts, stats->crc_errors, stats->last_us,
+			 stats->avg_us, stats->max_us);
+	}
+	mutex_unlock(&rs300->cmd_lock);
+
+	for (i = 0; i < RS300_STREAM_NUM_PHASES; i++)
+		dev_info(&client->dev, "last stream-on %s: %u us",
+			 rs300_stream_phase_names[i], rs300->stream_on_us[i]);
 
-static int rs300_power_off(struct device *dev)
-{
-	struct v4l2_subdev *sd = dev_get_drvdata(dev);
-	struct rs300 *rs300 = to_rs300(sd);
+	mutex_lock(&rs300->mutex);
+	dev_info(&client->dev, "standby: %s, %s", standby_menu[rs300->standby],
+		 rs300->streaming ? "streaming" :
+		 rs300->armed ? "armed" : "stopped");
+	mutex_unlock(&rs300->mutex);
 
-	gpiod_set_value_cansleep(rs300->reset_gpio, 1); //logic high -> device tree defines reset: logic high = 0V (active low)
-    dev_info(dev, "Resetting rs300");
-	regulator_bulk_disable(rs300_NUM_SUPPLIES, rs300->supplies);
-    dev_info(dev, "Regulators disabled");
+	dev_info(&client->dev, "ffc: every %u s%s, %u done, %u failed",
+		 READ_ONCE(rs300->ffc_interval),
+		 ktime_before(ktime_get(), READ_ONCE(rs300->ffc_defer_until)) ?
+		 " (deferred)" : "",
+		 READ_ONCE(rs300->ffc_count), READ_ONCE(rs300->ffc_failed));
+
+	mutex_lock(&rs300->mutex);
+	for (i = 0; i < RS300_NUM_PROFILES; i++)
+		dev_info(&client->dev, "profile %s: %s", profile_menu[i],
+			 test_bit(i, &rs300->profiles_valid) ? "saved" : "empty");
+	if (rs300->has_save_cmd)
+		dev_info(&client->dev, "flash: saved %u times",
+			 rs300->persist_count);
+	else
+		dev_info(&client->dev, "flash: no save command");
+	mutex_unlock(&rs300->mutex);
+
+	dev_info(&client->dev, "power: %s, %u resumes, last %u us, max %u us",
+		 pm_runtime_suspended(&client->dev) ? "suspended" : "active",
+		 READ_ONCE(rs300->resume_count),
+		 READ_ONCE(rs300->resume_last_us),
+		 READ_ONCE(rs300->resume_max_us));
+
+	dev_info(&client->dev, "verify: %s, %u checks, %u mismatches, %u failed reads",
+		 verify_menu[rs300->verify_policy],
+		 atomic_read(&rs300->verify_checks),
+		 atomic_read(&rs300->verify_mismatches),
+		 atomic_read(&rs300->verify_failures));
+
+	spin_lock(&rs300->ctrl_queue_lock);
+	dev_info(&client->dev, "control queue: %u pending, %u writes coalesced",
+		 rs300->ctrl_queue_len, rs300->ctrl_coalesced);
+	spin_unlock(&rs300->ctrl_queue_lock);
 
 	return 0;
 }
 
-static int rs300_get_regulators(struct rs300 *rs300)
+static int rs300_subscribe_event(struct v4l2_subdev *sd, struct v4l2_fh *fh,
+				 struct v4l2_event_subscription *sub)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-	unsigned int i;
-
-	for (i = 0; i < rs300_NUM_SUPPLIES; i++)
-		rs300->supplies[i].supply = rs300_supply_names[i];
-
-	return devm_regulator_bulk_get(&client->dev, 
-						rs300_NUM_SUPPLIES,
-				       rs300->supplies);
+	switch (sub->type) {
+	case RS300_EVENT_FFC_START:
+	case RS300_EVENT_FFC_END:
+		return v4l2_event_subscribe(fh, sub, 4, NULL);
+	case RS300_EVENT_CTRL_DONE:
+		return v4l2_event_subscribe(fh, sub, RS300_CTRL_QUEUE_LEN, NULL);
+	default:
+		return v4l2_ctrl_subdev_subscribe_event(sd, fh, sub);
+	}
 }
 
 static const struct v4l2_subdev_core_ops rs300_subdev_core_ops = {
-	.log_status = v4l2_ctrl_subdev_log_status,
-	.subscribe_event = v4l2_ctrl_subdev_subscribe_event,
+	.log_status = rs300_log_status,
+	.subscribe_event = rs300_subscribe_event,
 	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
 	.ioctl = rs300_ioctl, //NEEDED?
 };
 
 static const struct v4l2_subdev_video_ops rs300_subdev_video_ops = {
 	.s_stream = rs300_set_stream,
+	.g_frame_interval = rs300_g_frame_interval,
+	.s_frame_interval = rs300_s_frame_interval,
 };
 
 static int rs300_get_selection(struct v4l2_subdev *sd,
@@ -2265,6 +3270,7 @@ static const struct v4l2_subdev_pad_ops rs300_subdev_pad_ops = {
 	.get_fmt = rs300_get_pad_fmt,
 	.set_fmt = rs300_set_pad_fmt,
 	.enum_frame_size = rs300_enum_frame_sizes,
+	.enum_frame_interval = rs300_enum_frame_interval,
 	.get_selection = rs300_get_selection,
 	.set_selection = rs300_set_selection,
 };
@@ -2275,11 +3281,10 @@ static const struct v4l2_subdev_ops rs300_subdev_ops = {
 	.pad   = &rs300_subdev_pad_ops,
 };
 
-/*
 static const struct v4l2_subdev_internal_ops rs300_subdev_internal_ops = {
 	.open = rs300_open,
+	.close = rs300_close,
 };
-*/
 
 static const struct v4l2_ctrl_config colormap_ctrl = {
     .ops = &rs300_ctrl_ops,
@@ -2287,6 +3292,7 @@ static const struct v4l2_ctrl_config colormap_ctrl = {
     .name = "Colormap",
     .type = V4L2_CTRL_TYPE_MENU,
     .qmenu = colormap_menu,
+    .flags = V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
     .min = 0,
     .max = 11,
     .step = 1,
@@ -2349,20 +3355,160 @@ static const struct v4l2_ctrl_config temporal_nr_ctrl = {
     .def = 50,
 };
 
+static const struct v4l2_ctrl_config refresh_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_REFRESH,
+    .name = "Refresh State",
+    .type = V4L2_CTRL_TYPE_BUTTON,
+    .min = 0,
+    .max = 0,
+    .step = 0,
+    .def = 0,
+};
+
+static const struct v4l2_ctrl_config verify_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_VERIFY,
+    .name = "Verify Policy",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .qmenu = verify_menu,
+    .min = RS300_VERIFY_OFF,
+    .max = RS300_VERIFY_ALWAYS,
+    .step = 1,
+    .def = RS300_VERIFY_OFF,
+};
+
+static const struct v4l2_ctrl_config verify_interval_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_VERIFY_INTERVAL,
+    .name = "Verify Interval",
+    .type = V4L2_CTRL_TYPE_INTEGER,
+    .min = 1,
+    .max = 1000,
+    .step = 1,
+    .def = RS300_VERIFY_INTERVAL_DEFAULT,
+};
+
+static const struct v4l2_ctrl_config standby_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_STANDBY,
+    .name = "Warm Standby",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .qmenu = standby_menu,
+    .min = RS300_STANDBY_OFF,
+    .max = RS300_STANDBY_PREARM,
+    .step = 1,
+    .def = RS300_STANDBY_OFF,
+};
+
+static const struct v4l2_ctrl_config frame_meta_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_FRAME_META,
+    .name = "Frame Metadata",
+    .type = V4L2_CTRL_TYPE_U8,
+    .min = 0,
+    .max = 0xff,
+    .step = 1,
+    .def = 0,
+    .dims = { sizeof(struct rs300_frame_meta) },
+    .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+};
+
+static const struct v4l2_ctrl_config ffc_interval_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_FFC_INTERVAL,
+    .name = "FFC Interval",
+    .type = V4L2_CTRL_TYPE_INTEGER,
+    .min = 0,
+    .max = 3600,
+    .step = 1,
+    .def = 0,
+};
+
+static const struct v4l2_ctrl_config ffc_defer_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_FFC_DEFER,
+    .name = "FFC Defer",
+    .type = V4L2_CTRL_TYPE_INTEGER,
+    .min = 0,
+    .max = 3600000,
+    .step = 1,
+    .def = 0,
+    .flags = V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+};
+
+static const struct v4l2_ctrl_config ffc_on_stop_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_FFC_ON_STOP,
+    .name = "FFC at Stream-off",
+    .type = V4L2_CTRL_TYPE_BOOLEAN,
+    .min = 0,
+    .max = 1,
+    .step = 1,
+    .def = 0,
+};
+
+static const struct v4l2_ctrl_config profile_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_PROFILE,
+    .name = "Imaging Profile",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .min = 0,
+    .max = RS300_NUM_PROFILES - 1,
+    .def = 0,
+    .qmenu = profile_menu,
+    .flags = V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+};
+
+/* Profile 0 always holds the defaults */
+static const struct v4l2_ctrl_config profile_save_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_PROFILE_SAVE,
+    .name = "Save Imaging Profile",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .min = 1,
+    .max = RS300_NUM_PROFILES - 1,
+    .def = 1,
+    .qmenu = profile_menu,
+    .flags = V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+};
+
+static const struct v4l2_ctrl_config persist_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_PERSIST,
+    .name = "Save Parameters to Flash",
+    .type = V4L2_CTRL_TYPE_BUTTON,
+    .min = 0,
+    .max = 0,
+    .step = 0,
+    .def = 0,
+};
+
+static const struct v4l2_ctrl_config async_ctrl_ctrl = {
+    .ops = &rs300_ctrl_ops,
+    .id = V4L2_CID_RS300_ASYNC_CTRL,
+    .name = "Asynchronous Controls",
+    .type = V4L2_CTRL_TYPE_BOOLEAN,
+    .min = 0,
+    .max = 1,
+    .step = 1,
+    .def = 0,
+};
+
 static int rs300_init_controls(struct rs300 *rs300)
 {
+    struct v4l2_ctrl_config async_cfg = async_ctrl_ctrl;
+    struct v4l2_ctrl_config verify_cfg = verify_ctrl;
+    struct v4l2_ctrl_config standby_cfg = standby_ctrl;
+    unsigned int i;
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
     struct v4l2_ctrl_handler *ctrl_hdlr;
-    // Define link frequency menu items - values must be in ascending order
-    static const s64 link_freq_menu[] = {
-        RS300_LINK_RATE  // Single link frequency for testing
-    };
     int ret;
 
     dev_info(&client->dev, "Initializing controls");
     
     ctrl_hdlr = &rs300->ctrl_handler;
-    ret = v4l2_ctrl_handler_init(ctrl_hdlr, 11);
+    ret = v4l2_ctrl_handler_init(ctrl_hdlr, 23);
     if (ret) {
         dev_err(&client->dev, "Failed to init ctrl handler: %d", ret);
         return ret;
@@ -2371,20 +3517,19 @@ static int rs300_init_controls(struct rs300 *rs300)
     /* Set the lock for the control handler */
     ctrl_hdlr->lock = &rs300->mutex;
     
-    /* Add standard controls */
+    /* Add standard controls; both follow the mode and frame rate */
     rs300->link_frequency = v4l2_ctrl_new_int_menu(ctrl_hdlr, NULL,
         V4L2_CID_LINK_FREQ, 
-        0, // Maximum index (not array size)
+        rs300->num_link_freqs - 1, // Maximum index (not array size)
         0, // Default index
-        link_freq_menu);
+        rs300->link_freqs);
     
     if (rs300->link_frequency)
         rs300->link_frequency->flags |= V4L2_CTRL_FLAG_READ_ONLY;
 
     rs300->pixel_rate = v4l2_ctrl_new_std(ctrl_hdlr, NULL,
                                       V4L2_CID_PIXEL_RATE,
-                                      RS300_PIXEL_RATE, RS300_PIXEL_RATE, 1, 
-                                      RS300_PIXEL_RATE);
+                                      1, INT_MAX, 1, 1);
     
     if (rs300->pixel_rate)
         rs300->pixel_rate->flags |= V4L2_CTRL_FLAG_READ_ONLY;
@@ -2394,6 +3539,9 @@ static int rs300_init_controls(struct rs300 *rs300)
                          RS300_BRIGHTNESS_MIN, RS300_BRIGHTNESS_MAX,
                          RS300_BRIGHTNESS_STEP,
                          RS300_BRIGHTNESS_DEFAULT);
+    if (rs300->brightness)
+        rs300->brightness->flags |= V4L2_CTRL_FLAG_VOLATILE |
+                                    V4L2_CTRL_FLAG_EXECUTE_ON_WRITE;
 
     /* Add standard contrast control */
     rs300->contrast = v4l2_ctrl_new_std(ctrl_hdlr, &rs300_ctrl_ops,
@@ -2409,6 +3557,30 @@ static int rs300_init_controls(struct rs300 *rs300)
     rs300->spatial_nr = v4l2_ctrl_new_custom(ctrl_hdlr, &spatial_nr_ctrl, NULL);
     rs300->temporal_nr = v4l2_ctrl_new_custom(ctrl_hdlr, &temporal_nr_ctrl, NULL);
 
+    /* Asynchronous mode defaults to the async_ctrl module parameter */
+    async_cfg.def = rs300->async_ctrls;
+    v4l2_ctrl_new_custom(ctrl_hdlr, &async_cfg, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &refresh_ctrl, NULL);
+
+    /* Verification defaults to the verify module parameter */
+    verify_cfg.def = rs300->verify_policy;
+    v4l2_ctrl_new_custom(ctrl_hdlr, &verify_cfg, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &verify_interval_ctrl, NULL);
+
+    /* Warm standby defaults to the standby module parameter */
+    standby_cfg.def = rs300->standby;
+    v4l2_ctrl_new_custom(ctrl_hdlr, &standby_cfg, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &frame_meta_ctrl, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &ffc_interval_ctrl, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &ffc_defer_ctrl, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &ffc_on_stop_ctrl, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &profile_ctrl, NULL);
+    v4l2_ctrl_new_custom(ctrl_hdlr, &profile_save_ctrl, NULL);
+
+    /* Only firmware with a known save command can keep parameters */
+    if (rs300->has_save_cmd)
+        v4l2_ctrl_new_custom(ctrl_hdlr, &persist_ctrl, NULL);
+
     /* Check for errors */
     if (ctrl_hdlr->error) {
         ret = ctrl_hdlr->error;
@@ -2417,6 +3589,22 @@ static int rs300_init_controls(struct rs300 *rs300)
         goto error;
     }
     
+    for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+        rs300->param_ctrls[i] = v4l2_ctrl_find(ctrl_hdlr, rs300_params[i].ctrl_id);
+
+    /* One s_ctrl call for any set of image parameters */
+    v4l2_ctrl_cluster(RS300_NUM_PARAMS - 1,
+                      &rs300->param_ctrls[RS300_PARAM_NONE + 1]);
+
+    for (i = RS300_PARAM_NONE + 1; i < RS300_NUM_PARAMS; i++)
+        if (rs300->param_ctrls[i])
+            rs300->profiles[0][i] = rs300->param_ctrls[i]->default_value;
+    set_bit(0, &rs300->profiles_valid);
+
+    mutex_lock(&rs300->mutex);
+    rs300_update_link_freq(rs300);
+    mutex_unlock(&rs300->mutex);
+
     /* Connect the control handler to the subdevice */
     rs300->sd.ctrl_handler = ctrl_hdlr;
     
@@ -2435,127 +3623,196 @@ static void rs300_free_controls(struct rs300 *rs300)
 {
 	v4l2_ctrl_handler_free(&rs300->ctrl_handler);
 	mutex_destroy(&rs300->mutex);
+	mutex_destroy(&rs300->cmd_lock);
 }
 
-static int rs300_get_device_name(struct rs300 *rs300)
+static int rs300_get_device_name(struct rs300 *rs300, char *device_name,
+                                 size_t size)
 {
     struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
-    u8 cmd_buffer[18];
-    u8 status_buffer[1];
-    u8 result_buffer[40];  // Buffer to hold the device name response
+    u8 result_buffer[RS300_VCMD_RESULT_MAX];  // Buffer to hold the device name response
+    size_t name_length = 0;
     int ret;
-    int retry_count = 0;
-    const int max_retries = 5;
-    
-    dev_info(&client->dev, "Getting device name from camera");
-    
-    /* Add initial delay to ensure device is ready */
-    msleep(50);
-    
-    /* Test I2C communication first */
-    ret = read_regs(client, 0x0200, status_buffer, 1);
-    if (ret) {
-        dev_err(&client->dev, "Initial I2C communication test failed: %d", ret);
+
+    ret = rs300_vcmd_run(rs300, RS300_CMD_GET_DEVICE_NAME, 0, result_buffer);
+    if (ret)
         return ret;
+
+    /* Look for ASCII text in the response */
+    for (int i = 0; i < sizeof(result_buffer) && name_length < size - 1; i++) {
+        if (result_buffer[i] >= ' ' && result_buffer[i] <= '~') {
+            device_name[name_length++] = result_buffer[i];
+        }
     }
-    dev_info(&client->dev, "Initial I2C communication test passed");
-    
-    /* Construct the correct command buffer */
-    cmd_buffer[0] = 0x01;  /* Start marker */
-    cmd_buffer[1] = 0x01;  /* Command marker */
-    cmd_buffer[2] = 0x81;  /* Command ID */
-    cmd_buffer[3] = 0x00;  /* Reserved */
-    cmd_buffer[4] = 0x01;  /* Parameter 1 */
-    /* Fill remaining parameters */
-    memset(&cmd_buffer[5], 0x00, 11);  /* Zero out bytes 5-15 */
-    cmd_buffer[12] = 0x20; /* Set byte 12 to 0x20 */
-    /* Calculate CRC/checksum for the command */
-    unsigned short crc = do_crc(cmd_buffer, 16);
-    cmd_buffer[16] = 0xFC;  /* CRC bytes from example */
-    cmd_buffer[17] = 0x1E;
-    
-    dev_info(&client->dev, "Device name command buffer: %*ph", (int)sizeof(cmd_buffer), cmd_buffer);
-    
-    /* Write command with retry */
-    for (retry_count = 0; retry_count < max_retries; retry_count++) {
-        ret = write_regs(client, 0x1d00, cmd_buffer, sizeof(cmd_buffer));
-        if (ret == 0) {
+    device_name[name_length] = '\0';  // Ensure null termination
+
+    dev_dbg(&client->dev, "Raw response: %*ph", (int)sizeof(result_buffer), result_buffer);
+
+    return 0;
+}
+
+/*
+ * Identify the attached module from its device name, which carries the
+ * sensor width (e.g. "...640..."), and restrict the camera to that mode.
+ */
+static void rs300_identify(struct rs300 *rs300)
+{
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    const struct rs300_mode *found = NULL;
+    char name[RS300_DEVICE_NAME_LEN];
+    char width[8];
+    unsigned int i;
+    int ret;
+
+    ret = rs300_get_device_name(rs300, name, sizeof(name));
+    if (ret) {
+        dev_warn(&client->dev, "Failed to get device name: %d", ret);
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(supported_modes); i++) {
+        snprintf(width, sizeof(width), "%u", supported_modes[i].width);
+        if (strstr(name, width)) {
+            found = &supported_modes[i];
             break;
         }
-        dev_warn(&client->dev, "Write attempt %d failed: %d, retrying...", retry_count + 1, ret);
-        msleep(50);  // Wait before retry
     }
-    
+
+    mutex_lock(&rs300->mutex);
+
+    strscpy(rs300->device_name, name, sizeof(rs300->device_name));
+
+    if (!found) {
+        dev_info(&client->dev, "Camera %s: module resolution not recognised", name);
+        goto out;
+    }
+
+    dev_info(&client->dev, "Camera %s: %ux%u module", name,
+             found->width, found->height);
+
+    rs300->mode_mask = BIT(found - supported_modes);
+    if (rs300->mode == found)
+        goto out;
+
+    if (rs300->streaming) {
+        dev_warn(&client->dev, "Streaming at %ux%u, mode left unchanged",
+                 rs300->mode->width, rs300->mode->height);
+        goto out;
+    }
+
+    rs300->mode = found;
+    rs300->fps = rs300_mode_nearest_fps(found, rs300->fps);
+    rs300_set_default_format(rs300);
+    rs300_update_link_freq(rs300);
+
+out:
+    mutex_unlock(&rs300->mutex);
+}
+
+/*
+ * Deferred part of probe: everything that has to talk to the camera.
+ * Runs from the workqueue so boot does not wait on the camera; open and
+ * stream-on wait for it instead.
+ */
+static void rs300_init_work(struct work_struct *work)
+{
+    struct rs300 *rs300 = container_of(work, struct rs300, init_work);
+    struct i2c_client *client = v4l2_get_subdevdata(&rs300->sd);
+    int ret;
+
+    /* Probe has just powered the camera on; let it finish booting */
+    ret = rs300_wait_ready(rs300);
     if (ret) {
-        dev_err(&client->dev, "Failed to write device name command after %d retries: %d", max_retries, ret);
-        return ret;
+        dev_err(&client->dev, "Camera not ready after power on: %d", ret);
+        goto done;
     }
 
-    /* Read command status and wait for completion */
-    while (retry_count < max_retries) {
-        /* Wait for command processing */
-        msleep(50);
-        
-        /* Read command status from status register (0x0200) */
-        ret = read_regs(client, 0x0200, status_buffer, 1);
-        if (ret) {
-            dev_err(&client->dev, "Failed to read command status: %d", ret);
-            return ret;
-        }
-        
-        /* Check command status */
-        dev_info(&client->dev, "Device name command status: 0x%02X", status_buffer[0]);
-        
-        /* Extract status components */
-        bool is_busy = (status_buffer[0] & 0x01) != 0;
-        bool has_failed = (status_buffer[0] & 0x02) != 0;
-        u8 error_code = (status_buffer[0] >> 2) & 0x3F;  /* Bits 2-7 */
-        
-        /* Check if command is still busy */
-        if (is_busy) {
-            dev_info(&client->dev, "Device name command is busy, retrying...");
-            retry_count++;
-            continue;
-        }
-        
-        /* Check for errors */
-        if (has_failed) {
-            dev_err(&client->dev, "Device name command execution failed with error code: 0x%02X", error_code);
-            return -EIO;
-        }
-        
-        /* Command executed successfully, read the result */
-        ret = read_regs(client, 0x1d00, result_buffer, sizeof(result_buffer));
-        if (ret) {
-            dev_err(&client->dev, "Failed to read device name result: %d", ret);
-            return ret;
-        }
-        
-        /* Extract and null-terminate the device name (expecting ASCII response) */
-        char device_name[32] = {0};  // Larger buffer to be safe
-        int name_length = 0;
-        
-        /* Look for ASCII text in the response */
-        for (int i = 0; i < sizeof(result_buffer) && name_length < 31; i++) {
-            if (result_buffer[i] >= ' ' && result_buffer[i] <= '~') {
-                device_name[name_length++] = result_buffer[i];
-            }
-        }
-        device_name[name_length] = '\0';  // Ensure null termination
-        
-        dev_info(&client->dev, "Camera device name: %s", device_name);
-        dev_info(&client->dev, "Raw response: %*ph", (int)sizeof(result_buffer), result_buffer);
-        
-        return 0;
+    rs300_identify(rs300);
+
+    /* Fill the shadow cache with what the camera can report */
+    ret = rs300_shadow_refresh(rs300);
+    if (ret)
+        dev_warn(&client->dev, "Failed to read camera state: %d", ret);
+
+    /*
+     * Program the frame rate now, which a stream-on skips if the camera
+     * is still powered by then, or go all the way and start the camera
+     * for warm standby.
+     */
+    mutex_lock(&rs300->mutex);
+    if (rs300->standby == RS300_STANDBY_PREARM) {
+        ret = rs300_arm(rs300);
+        if (ret)
+            dev_warn(&client->dev, "Failed to arm camera: %d", ret);
+    } else if (!rs300->streaming) {
+        rs300_set_fps(rs300, rs300->fps);
     }
-    
-    /* If we get here, we've exceeded max retries */
-    dev_err(&client->dev, "Device name command timed out after %d retries", max_retries);
-    return -ETIMEDOUT;
+    mutex_unlock(&rs300->mutex);
+
+done:
+    complete_all(&rs300->init_done);
+
+    /* Drop the reference taken in probe; power down once idle */
+    pm_runtime_mark_last_busy(&client->dev);
+    pm_runtime_put_autosuspend(&client->dev);
+}
+
+/*
+ * Per-camera configuration. DT properties take precedence over the module
+ * parameters so several cameras can run different modes side by side.
+ */
+static void rs300_get_config(struct rs300 *rs300, struct device *dev)
+{
+	unsigned short crc;
+	u32 val;
+
+	/* Until the module is identified assume it can run any mode */
+	rs300->mode_mask = GENMASK(ARRAY_SIZE(supported_modes) - 1, 0);
+	rs300->mode = &supported_modes[clamp_t(int, mode, 0,
+					       ARRAY_SIZE(supported_modes) - 1)];
+	rs300->fps = fps;
+	rs300->type = type;
+	rs300->raw_type = raw_type;
+
+	if (!device_property_read_u32(dev, "infisense,mode", &val)) {
+		if (val < ARRAY_SIZE(supported_modes))
+			rs300->mode = &supported_modes[val];
+		else
+			dev_warn(dev, "Invalid infisense,mode %u\n", val);
+	}
+
+	if (!device_property_read_u32(dev, "infisense,fps", &val))
+		rs300->fps = val;
+
+	if (!rs300_mode_has_fps(rs300->mode, rs300->fps)) {
+		dev_warn(dev, "%d fps not supported at %ux%u\n", rs300->fps,
+			 rs300->mode->width, rs300->mode->height);
+		rs300->fps = rs300_mode_nearest_fps(rs300->mode, rs300->fps);
+	}
+
+	if (!device_property_read_u32(dev, "infisense,output-type", &val))
+		rs300->type = val;
+
+	if (!device_property_read_u32(dev, "infisense,raw-output-type", &val))
+		rs300->raw_type = val;
+
+	/* Command body only; the CRC is added here */
+	if (!device_property_read_u8_array(dev, "infisense,save-command",
+					   rs300->save_cmd, 16)) {
+		crc = do_crc(rs300->save_cmd, 16);
+		rs300->save_cmd[16] = crc & 0xff;
+		rs300->save_cmd[17] = crc >> 8;
+		rs300->has_save_cmd = true;
+	}
+
+	dev_info(dev, "Configured for %ux%u at %d fps, output type %d",
+		 rs300->mode->width, rs300->mode->height, rs300->fps,
+		 rs300->type);
 }
 
-static int rs300_check_hwcfg(struct device *dev)
+static int rs300_check_hwcfg(struct rs300 *rs300, struct device *dev)
 {
+	unsigned int i;
 	struct fwnode_handle *endpoint;
 	struct v4l2_fwnode_endpoint ep_cfg = {
 		.bus_type = V4L2_MBUS_CSI2_DPHY
@@ -2578,13 +3835,23 @@ static int rs300_check_hwcfg(struct device *dev)
 		goto error_out;
 	}
 	
-	if (ep_cfg.nr_of_link_frequencies != 1 ||
-	    ep_cfg.link_frequencies[0] != RS300_LINK_RATE) {
-		dev_err(dev, "Link frequency not supported: %lld\n",
-			ep_cfg.link_frequencies[0]);
+	if (!ep_cfg.nr_of_link_frequencies ||
+	    ep_cfg.nr_of_link_frequencies > RS300_MAX_LINK_FREQS) {
+		dev_err(dev, "1 to %d link frequencies are supported, got %u\n",
+			RS300_MAX_LINK_FREQS, ep_cfg.nr_of_link_frequencies);
 		goto error_out;
 	}
 
+	rs300->lanes = ep_cfg.bus.mipi_csi2.num_data_lanes;
+	rs300->num_link_freqs = ep_cfg.nr_of_link_frequencies;
+	for (i = 0; i < rs300->num_link_freqs; i++) {
+		if (!ep_cfg.link_frequencies[i]) {
+			dev_err(dev, "Link frequency %u is zero\n", i);
+			goto error_out;
+		}
+		rs300->link_freqs[i] = ep_cfg.link_frequencies[i];
+	}
+
 	ret = 0;
 
 error_out:
@@ -2615,13 +3882,20 @@ static int rs300_probe(struct i2c_client *client)
 	}
 	dev_dbg(dev, "Memory allocation successful");
 
+	/* kmalloc memory is DMA safe; tx also carries the register address */
+	rs300->xfer_tx = devm_kmalloc(dev, I2C_VD_BUFFER_DATA_LEN + 2, GFP_KERNEL);
+	rs300->xfer_rx = devm_kmalloc(dev, I2C_VD_BUFFER_DATA_LEN, GFP_KERNEL);
+	if (!rs300->xfer_tx || !rs300->xfer_rx)
+		return -ENOMEM;
+
 	dev_dbg(dev, "Initializing V4L2 subdev");
 	v4l2_i2c_subdev_init(&rs300->sd, client, &rs300_subdev_ops);
+	rs300->sd.internal_ops = &rs300_subdev_internal_ops;
 	dev_dbg(dev, "V4L2 subdev initialization complete");
 
 	/* Check the hardware configuration in device tree */
 	dev_dbg(dev, "Checking hardware configuration");
-	if (rs300_check_hwcfg(dev)) {
+	if (rs300_check_hwcfg(rs300, dev)) {
 		dev_err(dev, "Hardware configuration check failed");
 		return -EINVAL;
 	}
@@ -2651,33 +3925,52 @@ static int rs300_probe(struct i2c_client *client)
 	ret = rs300_power_on(dev);
 	if (ret) {
 		dev_err(dev, "Failed to power on rs300: %d", ret);
-		goto error_power_off;
+		return ret;
 	}
 	dev_dbg(dev, "Sensor powered on successfully");
 
-	/* Get device name 
-	ret = rs300_get_device_name(rs300);
-	if (ret) {
-		dev_warn(dev, "Failed to get device name: %d", ret);
-		// Don't fail probe on this error, just warn
-	}*/
+	/* Stay powered until the deferred initialisation has run */
+	pm_runtime_set_active(dev);
+	pm_runtime_get_noresume(dev);
+	pm_runtime_enable(dev);
+	pm_runtime_set_autosuspend_delay(dev, RS300_AUTOSUSPEND_DELAY_MS);
+	pm_runtime_use_autosuspend(dev);
 
-	/* Set default mode to 0=640x512, 1=256x192 */
-	rs300->mode = &supported_modes[mode];
+	/* Mode, frame rate and output type for this camera */
+	rs300_get_config(rs300, dev);
 
 	/* Initialize default format */
 	rs300_set_default_format(rs300);
 
 	/* Initialize mutex */
 	mutex_init(&rs300->mutex);
+	mutex_init(&rs300->cmd_lock);
+
+	/* Worker for asynchronous control application */
+	rs300->async_ctrls = !!async_ctrl;
+	rs300->verify_policy = clamp(verify, RS300_VERIFY_OFF, RS300_VERIFY_ALWAYS);
+	rs300->verify_interval = RS300_VERIFY_INTERVAL_DEFAULT;
+	rs300->standby = clamp(standby, RS300_STANDBY_OFF, RS300_STANDBY_PREARM);
+	spin_lock_init(&rs300->ctrl_queue_lock);
+	spin_lock_init(&rs300->ffc_lock);
+	INIT_WORK(&rs300->ctrl_work, rs300_ctrl_work);
+	INIT_WORK(&rs300->init_work, rs300_init_work);
+	INIT_DELAYED_WORK(&rs300->ffc_work, rs300_ffc_work);
+	INIT_DELAYED_WORK(&rs300->ffc_end_work, rs300_ffc_end_work);
+	init_completion(&rs300->init_done);
+	rs300->ctrl_wq = alloc_ordered_workqueue("rs300-%s", 0, dev_name(dev));
+	if (!rs300->ctrl_wq) {
+		ret = -ENOMEM;
+		goto error_pm;
+	}
 	
 	/* Initialize controls BEFORE registering the subdevice */
 	ret = rs300_init_controls(rs300);
 	if (ret) {
 		dev_err(dev, "failed to initialize controls\n");
-		goto error_power_off;
+		goto error_destroy_wq;
 	}
-	
+
 	/* Initialize subdev flags */
 	rs300->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE |
 			    V4L2_SUBDEV_FL_HAS_EVENTS;
@@ -2709,6 +4002,9 @@ static int rs300_probe(struct i2c_client *client)
 		dev_warn(dev, "Subdevice control handler is NULL!\n");
 	}
 
+	/* Talk to the camera without holding up boot */
+	queue_work(rs300->ctrl_wq, &rs300->init_work);
+
 	return 0;
 
 error_media_entity:
@@ -2717,7 +4013,14 @@ error_media_entity:
 error_handler_free:
 	v4l2_ctrl_handler_free(&rs300->ctrl_handler);		
 
-error_power_off:
+error_destroy_wq:
+	destroy_workqueue(rs300->ctrl_wq);
+
+error_pm:
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	pm_runtime_put_noidle(dev);
 	rs300_power_off(dev);
 
 	return ret;
@@ -2729,10 +4032,113 @@ static void rs300_remove(struct i2c_client *client)
 	struct rs300 *rs300 = to_rs300(sd);
 
 	v4l2_async_unregister_subdev(sd);
+
+	rs300_ffc_stop(rs300, true);
+
+	/* Runs any queued control writes before the handler goes away */
+	flush_workqueue(rs300->ctrl_wq);
+	cancel_delayed_work_sync(&rs300->ffc_work);
+	cancel_delayed_work_sync(&rs300->ffc_end_work);
+	destroy_workqueue(rs300->ctrl_wq);
+
+	mutex_lock(&rs300->mutex);
+	rs300_disarm(rs300);
+	mutex_unlock(&rs300->mutex);
 	media_entity_cleanup(&sd->entity);
 	rs300_free_controls(rs300);
 
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	if (!pm_runtime_status_suspended(&client->dev))
+		rs300_power_off(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+}
+
+/* -----------------------------------------------------------------------------
+ * sysfs statistics
+ */
+
+static ssize_t coalesced_writes_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(rs300->ctrl_coalesced));
+}
+static DEVICE_ATTR_RO(coalesced_writes);
+
+static ssize_t verify_checks_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+
+	return sysfs_emit(buf, "%d\n", atomic_read(&rs300->verify_checks));
+}
+static DEVICE_ATTR_RO(verify_checks);
+
+static ssize_t verify_mismatches_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+
+	return sysfs_emit(buf, "%d\n", atomic_read(&rs300->verify_mismatches));
+}
+static DEVICE_ATTR_RO(verify_mismatches);
+
+static ssize_t device_name_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+	ssize_t len;
+
+	mutex_lock(&rs300->mutex);
+	len = sysfs_emit(buf, "%s\n", rs300->device_name);
+	mutex_unlock(&rs300->mutex);
+
+	return len;
+}
+static DEVICE_ATTR_RO(device_name);
+
+/* Duration of each phase of the last stream-on, in microseconds */
+static ssize_t stream_on_latency_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < RS300_STREAM_NUM_PHASES; i++)
+		len += sysfs_emit_at(buf, len, "%s %u\n",
+				     rs300_stream_phase_names[i],
+				     READ_ONCE(rs300->stream_on_us[i]));
+
+	return len;
+}
+static DEVICE_ATTR_RO(stream_on_latency);
+
+/* Power-on to mailbox ready for the last and slowest runtime resume */
+static ssize_t resume_latency_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct rs300 *rs300 = to_rs300(dev_get_drvdata(dev));
+
+	return sysfs_emit(buf, "last %u\nmax %u\ncount %u\n",
+			  READ_ONCE(rs300->resume_last_us),
+			  READ_ONCE(rs300->resume_max_us),
+			  READ_ONCE(rs300->resume_count));
 }
+static DEVICE_ATTR_RO(resume_latency);
+
+static struct attribute *rs300_attrs[] = {
+	&dev_attr_coalesced_writes.attr,
+	&dev_attr_device_name.attr,
+	&dev_attr_verify_checks.attr,
+	&dev_attr_verify_mismatches.attr,
+	&dev_attr_stream_on_latency.attr,
+	&dev_attr_resume_latency.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(rs300);
 
 static const struct i2c_device_id rs300_id[] = {
 	{ "rs300", 0 },
@@ -2752,6 +4158,9 @@ static struct i2c_driver rs300_i2c_driver = {
 	.driver = {
 		.name	= DRIVER_NAME,
 		.of_match_table = of_match_ptr(rs300_of_match),
+		.dev_groups = rs300_groups,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+		.pm = &rs300_pm_ops,
 	},
 	.probe		= rs300_probe,
 	.remove		= rs300_remove,